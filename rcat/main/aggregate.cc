@@ -0,0 +1,427 @@
+#include "aggregate.h"
+
+#include <algorithm>	// max
+#include <cerrno>	// errno
+#include <cstdio>	// snprintf
+#include <cstdlib>	// exit, strtod, strtoull
+#include <cstring>	// memchr, memcpy, strchr, strlen
+#include <iostream>	// cerr
+
+namespace rcat {
+
+static const std::size_t kInitialSlots(1024);
+
+bool ParseAggregations(const char *s, std::vector<Aggregation> &aggs)
+{
+	static const struct {
+		const char *name;
+		Aggregation::Function function;
+	} kFunctions[] = {
+		{ "sum:", Aggregation::kSum },
+		{ "min:", Aggregation::kMin },
+		{ "max:", Aggregation::kMax },
+	};
+
+	for (;;) {
+		const char *const comma(std::strchr(s, ','));
+		const std::string spec(
+			s, comma != NULL ? comma : s + std::strlen(s));
+
+		Aggregation agg = { Aggregation::kCount, 0 };
+		if (spec != "count") {
+			bool found(false);
+			for (const auto &f : kFunctions) {
+				if (spec.compare(0, 4, f.name) != 0)
+					continue;
+
+				const char *const col(spec.c_str() + 4);
+				if (*col < '1' || *col > '9')
+					return false;
+				char *end(NULL);
+				errno = 0;
+				agg.function = f.function;
+				agg.column = std::strtoull(col, &end, 10);
+				if (errno != 0 || *end != '\0')
+					return false;
+				found = true;
+			}
+			if (!found)
+				return false;
+		}
+		aggs.push_back(agg);
+
+		if (comma == NULL)
+			return true;
+		s = comma + 1;
+	}
+}
+
+// Parse 8 ASCII digits at once as in "Faster Integer Parsing" by Lemire.
+// Return false if any of them is not a digit.
+static inline bool ParseEightDigits(const char *p, std::uint64_t &v)
+{
+	std::uint64_t x;
+	std::memcpy(&x, p, sizeof(x));
+	if (((x & 0xF0F0F0F0F0F0F0F0) |
+			(((x + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+			0x3333333333333333)
+		return false;
+
+	x -= 0x3030303030303030;
+	x = (x * 10) + (x >> 8);
+	x = (((x & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+		(((x >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32))))
+		>> 32;
+	v = x;
+	return true;
+}
+
+// Parse an optionally signed decimal integer of up to 18 digits.
+static bool ParseInteger(const char *p, std::size_t n, std::int64_t &v)
+{
+	bool negative(false);
+	if (n != 0 && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		++p;
+		--n;
+	}
+	if (n == 0 || n > 18)
+		return false;
+
+	std::uint64_t u(0);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; n >= 8; p += 8, n -= 8) {
+		std::uint64_t chunk(0);
+		if (!ParseEightDigits(p, chunk))
+			return false;
+		u = u * 100000000 + chunk;
+	}
+#endif
+	for (; n > 0; ++p, --n) {
+		if (*p < '0' || *p > '9')
+			return false;
+		u = u * 10 + (*p - '0');
+	}
+
+	v = negative ? -static_cast<std::int64_t>(u) :
+		static_cast<std::int64_t>(u);
+	return true;
+}
+
+// Parse a number, which is either an integer or anything strtod()
+// takes as a whole.
+static bool ParseNumber(const char *p, std::size_t n,
+	bool &integral, std::int64_t &i, double &d)
+{
+	if (ParseInteger(p, n, i)) {
+		integral = true;
+		d = static_cast<double>(i);
+		return true;
+	}
+
+	char buf[64];
+	if (n == 0 || n >= sizeof(buf))
+		return false;
+	std::memcpy(buf, p, n);
+	buf[n] = '\0';
+
+	char *end(NULL);
+	errno = 0;
+	d = std::strtod(buf, &end);
+	if (errno != 0 || end != buf + n)
+		return false;
+
+	integral = false;
+	return true;
+}
+
+static inline std::uint64_t Mix(std::uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCD;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hash a key a word at a time.
+static std::uint64_t Hash(const char *p, std::size_t n)
+{
+	std::uint64_t h(0x9E3779B97F4A7C15 ^ n);
+	for (; n >= 8; p += 8, n -= 8) {
+		std::uint64_t w;
+		std::memcpy(&w, p, sizeof(w));
+		h = Mix(h ^ w);
+	}
+	if (n != 0) {
+		std::uint64_t w(0);
+		std::memcpy(&w, p, n);
+		h = Mix(h ^ w);
+	}
+	return Mix(h);
+}
+
+Aggregator::Aggregator(std::size_t key_column,
+	const std::vector<Aggregation> &aggs,
+	char field_separator, bool framed, RecordSink &out)
+	: key_column_(key_column),
+	  aggs_(aggs),
+	  separator_(field_separator),
+	  framed_(framed),
+	  out_(out),
+	  max_column_(key_column),
+	  field_begins_(),
+	  field_lengths_(),
+	  groups_(),
+	  keys_(),
+	  values_(),
+	  slots_(kInitialSlots)
+{
+	for (const Aggregation &agg : aggs_)
+		max_column_ = std::max(max_column_, agg.column);
+	field_begins_.resize(max_column_ + 1);
+	field_lengths_.resize(max_column_ + 1);
+}
+
+static void NoColumn(std::size_t column)
+{
+	std::cerr << "no column " << column << " to aggregate" << std::endl;
+	std::exit(1);
+}
+
+// Find fields of a record up to "max_column_".
+void Aggregator::SplitFields(const std::string &record)
+{
+	const char *p(record.data());
+	const char *const end(p + record.size());
+	if (framed_) {
+		for (std::size_t column = 1; column <= max_column_; ++column) {
+			if (!ParseFramedField(p, end, field_begins_[column],
+					field_lengths_[column]))
+				NoColumn(max_column_);
+		}
+		return;
+	}
+
+	for (std::size_t column = 1; column <= max_column_; ++column) {
+		const char *q(static_cast<const char *>(
+			std::memchr(p, separator_, end - p)));
+		if (q == NULL) {
+			if (column != max_column_)
+				NoColumn(max_column_);
+			q = end;
+		}
+
+		field_begins_[column] = p;
+		field_lengths_[column] = q - p;
+		p = q + 1;
+	}
+}
+
+// Append a field to a record being made, after a separator unless it is
+// the "first" one.
+void Aggregator::AppendField(std::string &record, bool first,
+	const char *field, std::size_t length) const
+{
+	if (framed_) {
+		AppendVarint(record, length);
+	} else if (!first) {
+		record.push_back(separator_);
+	}
+	record.append(field, length);
+}
+
+void Aggregator::Header(const std::string &record)
+{
+	SplitFields(record);
+
+	std::string header;
+	if (key_column_ != 0)
+		AppendField(header, true, field_begins_[key_column_],
+			field_lengths_[key_column_]);
+
+	std::string name;
+	for (std::size_t i = 0; i < aggs_.size(); ++i) {
+		const Aggregation &agg(aggs_[i]);
+
+		static const char *const kNames[] = {
+			"count", "sum", "min", "max",
+		};
+		name.assign(kNames[agg.function]);
+		if (agg.function != Aggregation::kCount) {
+			name.push_back('(');
+			name.append(field_begins_[agg.column],
+				field_lengths_[agg.column]);
+			name.push_back(')');
+		}
+		AppendField(header, i == 0 && key_column_ == 0,
+			name.data(), name.size());
+	}
+
+	Emit(header, true);
+}
+
+void Aggregator::Body(const std::string &record)
+{
+	SplitFields(record);
+
+	const std::size_t group(key_column_ == 0 ?
+		FindOrAddGroup("", 0) :
+		FindOrAddGroup(field_begins_[key_column_],
+			field_lengths_[key_column_]));
+	++groups_[group].count;
+
+	Value *const values(&values_[group * aggs_.size()]);
+	for (std::size_t i = 0; i < aggs_.size(); ++i) {
+		const Aggregation &agg(aggs_[i]);
+		if (agg.function == Aggregation::kCount)
+			continue;
+
+		// empty fields, such as padding, are missing values
+		const std::size_t length(field_lengths_[agg.column]);
+		if (length == 0)
+			continue;
+
+		Value v = { true, false, 0, 0.0 };
+		if (!ParseNumber(field_begins_[agg.column], length,
+				v.integral, v.i, v.d)) {
+			std::cerr << "not a number: " << std::string(
+				field_begins_[agg.column], length) << std::endl;
+			std::exit(1);
+		}
+
+		Value &acc(values[i]);
+		if (!acc.valid) {
+			acc = v;
+			continue;
+		}
+
+		const bool integral(acc.integral && v.integral);
+		switch (agg.function) {
+		case Aggregation::kSum:
+			if (integral &&
+					!__builtin_add_overflow(acc.i, v.i, &acc.i)) {
+				acc.d = static_cast<double>(acc.i);
+			} else {
+				acc.integral = false;
+				acc.d += v.d;
+			}
+			break;
+		case Aggregation::kMin:
+			if (integral ? v.i < acc.i : v.d < acc.d)
+				acc = v;
+			break;
+		case Aggregation::kMax:
+			if (integral ? v.i > acc.i : v.d > acc.d)
+				acc = v;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+std::size_t Aggregator::FindOrAddGroup(const char *key, std::size_t length)
+{
+	const std::uint64_t hash(Hash(key, length));
+	const std::size_t mask(slots_.size() - 1);
+	for (std::size_t i = hash & mask; ; i = (i + 1) & mask) {
+		Slot &slot(slots_[i]);
+		if (slot.group == 0) {
+			groups_.push_back(Group { keys_.size(), length, 0 });
+			keys_.append(key, length);
+			values_.resize(values_.size() + aggs_.size(),
+				Value { false, true, 0, 0.0 });
+
+			slot.hash = hash;
+			slot.group = static_cast<std::uint32_t>(groups_.size());
+			if (groups_.size() * 2 > slots_.size())
+				Grow();
+			return groups_.size() - 1;
+		}
+
+		const Group &group(groups_[slot.group - 1]);
+		if (slot.hash == hash && group.key_length == length &&
+				keys_.compare(group.key_offset, length,
+					key, length) == 0)
+			return slot.group - 1;
+	}
+}
+
+// Double the hash table, keeping its load factor no more than 1/2.
+void Aggregator::Grow()
+{
+	std::vector<Slot> slots(slots_.size() * 2);
+	const std::size_t mask(slots.size() - 1);
+	for (const Slot &slot : slots_) {
+		if (slot.group == 0)
+			continue;
+
+		std::size_t i(slot.hash & mask);
+		while (slots[i].group != 0)
+			i = (i + 1) & mask;
+		slots[i] = slot;
+	}
+	slots_.swap(slots);
+}
+
+void Aggregator::Finish()
+{
+	// all of no records are still a group
+	if (key_column_ == 0 && groups_.empty())
+		FindOrAddGroup("", 0);
+
+	std::string record;
+	for (std::size_t g = 0; g < groups_.size(); ++g) {
+		record.clear();
+		if (key_column_ != 0)
+			AppendField(record, true,
+				keys_.data() + groups_[g].key_offset,
+				groups_[g].key_length);
+
+		const Value *const values(&values_[g * aggs_.size()]);
+		for (std::size_t i = 0; i < aggs_.size(); ++i) {
+			char buf[32];
+			const Value &v(values[i]);
+			if (aggs_[i].function == Aggregation::kCount)
+				std::snprintf(buf, sizeof(buf), "%llu",
+					static_cast<unsigned long long>(
+						groups_[g].count));
+			else if (!v.valid)
+				buf[0] = '\0';
+			else if (v.integral)
+				std::snprintf(buf, sizeof(buf), "%lld",
+					static_cast<long long>(v.i));
+			else
+				std::snprintf(buf, sizeof(buf), "%.15g", v.d);
+			AppendField(record, i == 0 && key_column_ == 0,
+				buf, std::strlen(buf));
+		}
+
+		Emit(record, false);
+	}
+	out_.Finish();
+}
+
+void Aggregator::Emit(const std::string &record, bool header)
+{
+	const std::string *text(&record);
+	std::string converted;
+	if (out_.framed() && !framed_) {
+		AppendFramedFields(converted, record, separator_);
+		text = &converted;
+	} else if (!out_.framed() && framed_) {
+		if (!AppendTextFields(converted, record, separator_)) {
+			std::cerr << "unrepresentable field in aggregates"
+				<< std::endl;
+			std::exit(1);
+		}
+		text = &converted;
+	}
+
+	if (header)
+		out_.Header(*text);
+	else
+		out_.Body(*text);
+}
+
+} // namespace rcat
@@ -0,0 +1,93 @@
+#ifndef RCAT_AGGREGATE_H
+#define RCAT_AGGREGATE_H
+
+#include <cstddef>	// size_t
+#include <cstdint>	// int64_t, uint32_t, uint64_t
+#include <string>
+#include <vector>
+
+#include "record_sink.h"
+
+namespace rcat {
+
+// An aggregate function over a 1-origin column of joined records.
+struct Aggregation {
+	enum Function {
+		kCount,
+		kSum,
+		kMin,
+		kMax,
+	};
+
+	Function function;
+	std::size_t column; // unused for kCount
+};
+
+// Parse "count", "sum:COLUMN", "min:COLUMN" or "max:COLUMN" separated
+// by commas. Return false if malformed.
+bool ParseAggregations(const char *s, std::vector<Aggregation> &aggs);
+
+// A sink grouping records by the value of "key_column" (or all of them
+// if 0) and computing "aggs" of each group. When finished, each group is
+// passed to "out" in the order it first appeared, after a header naming
+// the columns after the joined header. Records are the payloads of framed
+// ones if "framed", and text ones otherwise, and so are those it makes.
+class Aggregator : public RecordSink {
+public:
+	Aggregator(std::size_t key_column,
+		const std::vector<Aggregation> &aggs,
+		char field_separator, bool framed, RecordSink &out);
+
+	bool framed() const override { return framed_; }
+	void Header(const std::string &record) override;
+	void Body(const std::string &record) override;
+	void Finish() override;
+
+private:
+	// a number which stays an exact integer as long as it can
+	struct Value {
+		bool valid;
+		bool integral;
+		std::int64_t i;
+		double d;
+	};
+
+	struct Group {
+		std::size_t key_offset;
+		std::size_t key_length;
+		std::uint64_t count;
+	};
+
+	struct Slot {
+		std::uint64_t hash;
+		std::uint32_t group; // 1-origin; 0 means an empty slot
+	};
+
+	void SplitFields(const std::string &record);
+	void AppendField(std::string &record, bool first,
+		const char *field, std::size_t length) const;
+	std::size_t FindOrAddGroup(const char *key, std::size_t length);
+	void Grow();
+	void Emit(const std::string &record, bool header);
+
+	const std::size_t key_column_;
+	const std::vector<Aggregation> aggs_;
+	const char separator_;
+	const bool framed_;
+	RecordSink &out_;
+
+	std::size_t max_column_;
+	std::vector<const char *> field_begins_;
+	std::vector<std::size_t> field_lengths_;
+
+	// groups in the order of appearance, their keys and values, and an
+	// open-addressing hash table of them with linear probing
+	std::vector<Group> groups_;
+	std::string keys_;
+	std::vector<Value> values_;
+	std::vector<Slot> slots_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_AGGREGATE_H
@@ -0,0 +1,153 @@
+#include "batch_reader.h"
+
+#include <algorithm>	// max, min
+#include <utility>	// move
+
+namespace rcat {
+
+// batches read ahead of the one being consumed
+static const std::size_t kMaxFilledBatches(2);
+
+BatchReader::BatchReader(
+	Read read, bool read_ahead, std::size_t batch_size)
+	: read_(std::move(read)),
+	  batch_size_(read_ahead ? std::max<std::size_t>(batch_size, 1) : 1),
+	  current_(),
+	  position_(0),
+	  filled_(),
+	  free_(),
+	  stopping_(false),
+	  mutex_(),
+	  cond_filled_(),
+	  cond_freed_(),
+	  worker_()
+{
+	for (std::size_t i = 0; i < kMaxFilledBatches; ++i) {
+		free_.emplace_back(new Batch());
+		free_.back()->lines.resize(batch_size_);
+		free_.back()->nr_seps.resize(batch_size_);
+		free_.back()->errors.resize(batch_size_);
+	}
+	if (read_ahead)
+		worker_ = std::thread(&BatchReader::Work, this);
+}
+
+BatchReader::~BatchReader()
+{
+	if (!worker_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cond_freed_.notify_all();
+	worker_.join();
+}
+
+bool BatchReader::Next(std::string &line, int &nr_seps, const char *&error)
+{
+	if (!Fill()) {
+		error = current_->end_error;
+		return false;
+	}
+
+	line.swap(current_->lines[position_]);
+	nr_seps = current_->nr_seps[position_];
+	error = current_->errors[position_];
+	++position_;
+	return true;
+}
+
+void BatchReader::Skip(std::uint64_t n)
+{
+	while (n > 0 && Fill()) {
+		const std::size_t m(static_cast<std::size_t>(std::min<std::uint64_t>(
+			n, current_->size - position_)));
+		position_ += m;
+		n -= m;
+	}
+}
+
+bool BatchReader::AtEnd()
+{
+	// a broken end is left for Next() to report
+	return !Fill() && current_->end_error == NULL;
+}
+
+// Make sure that "current_" has a record left unless at the end, giving
+// back consumed batches to the worker, or reading the next record if
+// there is no worker.
+bool BatchReader::Fill()
+{
+	while (!current_ || position_ == current_->size) {
+		if (current_ && current_->last)
+			return false;
+
+		if (!worker_.joinable()) {
+			if (!current_) {
+				current_ = std::move(free_.back());
+				free_.pop_back();
+			}
+			ReadBatch(*current_);
+			position_ = 0;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (current_) {
+			free_.push_back(std::move(current_));
+			cond_freed_.notify_one();
+		}
+		while (filled_.empty())
+			cond_filled_.wait(lock);
+		current_ = std::move(filled_.front());
+		filled_.pop_front();
+		position_ = 0;
+	}
+	return true;
+}
+
+void BatchReader::ReadBatch(Batch &batch)
+{
+	batch.size = 0;
+	batch.last = false;
+	batch.end_error = NULL;
+	while (batch.size < batch_size_) {
+		const char *error(NULL);
+		if (!read_(batch.lines[batch.size], batch.nr_seps[batch.size],
+				error)) {
+			batch.last = true;
+			batch.end_error = error;
+			break;
+		}
+		batch.errors[batch.size] = error;
+		++batch.size;
+	}
+}
+
+void BatchReader::Work()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		while (free_.empty() && !stopping_)
+			cond_freed_.wait(lock);
+		if (stopping_)
+			return;
+
+		std::unique_ptr<Batch> batch(std::move(free_.back()));
+		free_.pop_back();
+		lock.unlock();
+
+		ReadBatch(*batch);
+
+		lock.lock();
+		const bool last(batch->last);
+		filled_.push_back(std::move(batch));
+		cond_filled_.notify_one();
+		if (last)
+			return;
+	}
+}
+
+} // namespace rcat
@@ -0,0 +1,84 @@
+#ifndef RCAT_BATCH_READER_H
+#define RCAT_BATCH_READER_H
+
+#include <condition_variable>
+#include <cstddef>	// size_t
+#include <cstdint>	// uint64_t
+#include <deque>
+#include <functional>
+#include <memory>	// unique_ptr
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rcat {
+
+// A reader which reads and validates records of a file on a thread of
+// its own, a batch of them at a time, so that the thread consuming them
+// only checks the results. "read" is called on the thread to read a
+// record and count its field separators, and returns false at the end.
+// Rather than failing on its own, "read" sets "error" for the consumer
+// to report once it takes the record: a record which cannot be used, or
+// with false returned, the end of a file in the middle of a record.
+//
+// Unless "read_ahead", there is no thread, and "read" is called on the
+// consumer's one for each record as it is taken. That is for a file
+// which may block reading, such as a pipe, so that a reader never has
+// to wait for records which nobody takes before it is destroyed.
+class BatchReader {
+public:
+	typedef std::function<
+		bool(std::string &line, int &nr_seps, const char *&error)> Read;
+
+	static const std::size_t kDefaultBatchSize = 4096;
+
+	explicit BatchReader(Read read, bool read_ahead = true,
+		std::size_t batch_size = kDefaultBatchSize);
+	~BatchReader();
+
+	BatchReader(const BatchReader &) = delete;
+	BatchReader &operator=(const BatchReader &) = delete;
+
+	// Take the next record, and why it cannot be used if so in "error".
+	// Return false at the end, with "error" set if the file is broken.
+	bool Next(std::string &line, int &nr_seps, const char *&error);
+
+	// Discard "n" records, whose errors are ignored as they are unused.
+	void Skip(std::uint64_t n);
+
+	// Whether no record is left, waiting for the next batch if needed.
+	bool AtEnd();
+
+private:
+	struct Batch {
+		std::vector<std::string> lines;
+		std::vector<int> nr_seps;
+		std::vector<const char *> errors;
+		std::size_t size;
+		bool last;
+		const char *end_error;	// why the file ended, if broken
+	};
+
+	bool Fill();
+	void ReadBatch(Batch &batch);
+	void Work();
+
+	const Read read_;
+	const std::size_t batch_size_;
+
+	// a batch being consumed, and ones read ahead or to be reused
+	std::unique_ptr<Batch> current_;
+	std::size_t position_;
+	std::deque<std::unique_ptr<Batch>> filled_;
+	std::vector<std::unique_ptr<Batch>> free_;
+	bool stopping_;
+	std::mutex mutex_;
+	std::condition_variable cond_filled_;
+	std::condition_variable cond_freed_;
+	std::thread worker_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_BATCH_READER_H
@@ -0,0 +1,62 @@
+#include "follow.h"
+
+#include <cerrno>	// errno, EINTR, EAGAIN
+#include <cstdlib>	// exit
+#include <iostream>	// cerr
+
+#include <sys/epoll.h>	// epoll_create1, epoll_ctl, epoll_wait
+#include <sys/inotify.h>	// inotify_init1, inotify_add_watch
+#include <unistd.h>	// close, read
+
+namespace rcat {
+
+FileWatcher::FileWatcher()
+	: inotify_fd_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+	  epoll_fd_(::epoll_create1(EPOLL_CLOEXEC))
+{
+	if (inotify_fd_ == -1 || epoll_fd_ == -1) {
+		std::cerr << "cannot watch files" << std::endl;
+		std::exit(1);
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = inotify_fd_;
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, inotify_fd_, &ev) != 0) {
+		std::cerr << "cannot watch files" << std::endl;
+		std::exit(1);
+	}
+}
+
+FileWatcher::~FileWatcher()
+{
+	::close(epoll_fd_);
+	::close(inotify_fd_);
+}
+
+void FileWatcher::Watch(const std::string &path)
+{
+	if (::inotify_add_watch(inotify_fd_, path.c_str(),
+			IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+		std::cerr << "cannot watch " << path << std::endl;
+		std::exit(1);
+	}
+}
+
+void FileWatcher::Wait()
+{
+	struct epoll_event ev;
+	while (::epoll_wait(epoll_fd_, &ev, 1, -1) == -1) {
+		if (errno != EINTR) {
+			std::cerr << "cannot wait for files" << std::endl;
+			std::exit(1);
+		}
+	}
+
+	// drain events, since which ones they are does not matter
+	alignas(struct inotify_event) char buf[4096];
+	while (::read(inotify_fd_, buf, sizeof(buf)) > 0)
+		;
+}
+
+} // namespace rcat
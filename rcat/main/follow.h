@@ -0,0 +1,32 @@
+#ifndef RCAT_FOLLOW_H
+#define RCAT_FOLLOW_H
+
+#include <string>
+
+namespace rcat {
+
+// A watcher of files being written, with which a reader reaching the end
+// of a file sleeps until any of them is modified, as tail -f does but
+// without polling.
+class FileWatcher {
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher &) = delete;
+	FileWatcher &operator=(const FileWatcher &) = delete;
+
+	// Watch a file. Exit(1) if it cannot be.
+	void Watch(const std::string &path);
+
+	// Wait until any of the files is modified since the last call.
+	void Wait();
+
+private:
+	int inotify_fd_;
+	int epoll_fd_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_FOLLOW_H
@@ -0,0 +1,224 @@
+#include "framing.h"
+
+#include <algorithm>	// min
+#include <cstring>	// memchr
+
+namespace rcat {
+
+// no varint of uint64_t is longer than this
+static const int kMaxVarintSize(10);
+
+// bytes of a payload read at once
+static const std::size_t kReadChunkSize(1 << 16);
+
+static int EncodeVarint(char *buf, std::uint64_t v)
+{
+	int n(0);
+	while (v >= 0x80) {
+		buf[n++] = static_cast<char>((v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = static_cast<char>(v);
+	return n;
+}
+
+void AppendVarint(std::string &s, std::uint64_t v)
+{
+	char buf[kMaxVarintSize];
+	s.append(buf, EncodeVarint(buf, v));
+}
+
+static bool ParseVarint(const char *&p, const char *end, std::uint64_t &v)
+{
+	v = 0;
+	for (int i = 0; i < kMaxVarintSize && p != end; ++i) {
+		const unsigned char c(static_cast<unsigned char>(*p++));
+		v |= static_cast<std::uint64_t>(c & 0x7F) << (7 * i);
+		if (c < 0x80)
+			return true;
+	}
+	return false;
+}
+
+bool ParseFramedField(const char *&p, const char *end,
+	const char *&field, std::size_t &length)
+{
+	std::uint64_t v(0);
+	if (!ParseVarint(p, end, v) || v > static_cast<std::uint64_t>(end - p))
+		return false;
+
+	field = p;
+	length = v;
+	p += v;
+	return true;
+}
+
+const char *FrameStatusMessage(FrameStatus status)
+{
+	return (status == kFrameMalformed) ?
+		"malformed framed record" : "truncated framed record";
+}
+
+// Read a varint, which is truncated if "stream" ends in it unless it has
+// not begun.
+static FrameStatus ReadVarint(std::istream &stream, std::uint64_t &v)
+{
+	std::streambuf &sb(*stream.rdbuf());
+	v = 0;
+	for (int i = 0; i < kMaxVarintSize; ++i) {
+		const std::istream::int_type c(sb.sbumpc());
+		if (std::istream::traits_type::eq_int_type(
+				c, std::istream::traits_type::eof())) {
+			stream.setstate(std::ios::eofbit);
+			return (i == 0) ? kFrameEnd : kFrameTruncated;
+		}
+
+		v |= static_cast<std::uint64_t>(c & 0x7F) << (7 * i);
+		if (c < 0x80)
+			return kFrameRead;
+	}
+	return kFrameMalformed;
+}
+
+FrameStatus ReadFramedRecord(std::istream &stream, std::string &payload)
+{
+	payload.clear();
+	std::uint64_t length(0);
+	const FrameStatus status(ReadVarint(stream, length));
+	if (status != kFrameRead)
+		return status;
+
+	std::streambuf &sb(*stream.rdbuf());
+	while (length > 0) {
+		const std::size_t n(static_cast<std::size_t>(
+			std::min<std::uint64_t>(length, kReadChunkSize)));
+		const std::size_t offset(payload.size());
+		payload.resize(offset + n);
+		if (sb.sgetn(&payload[offset], n) !=
+				static_cast<std::streamsize>(n)) {
+			stream.setstate(std::ios::eofbit);
+			return kFrameTruncated;
+		}
+		length -= n;
+	}
+	return kFrameRead;
+}
+
+// Read "length" bytes through, for a stream which cannot seek.
+static FrameStatus IgnorePayload(std::istream &stream, std::uint64_t length)
+{
+	std::streambuf &sb(*stream.rdbuf());
+	for (std::uint64_t i = 0; i < length; ++i) {
+		if (std::istream::traits_type::eq_int_type(sb.sbumpc(),
+				std::istream::traits_type::eof())) {
+			stream.setstate(std::ios::eofbit);
+			return kFrameTruncated;
+		}
+	}
+	return kFrameRead;
+}
+
+FrameStatus SkipFramedRecords(std::istream &stream, std::uint64_t n)
+{
+	if (n == 0)
+		return kFrameRead;
+
+	// seeking past the end succeeds, so that it is checked against the
+	// size of a stream
+	std::streambuf &sb(*stream.rdbuf());
+	const std::streampos here(sb.pubseekoff(0, std::ios::cur, std::ios::in));
+	std::streampos end(-1);
+	if (here != std::streampos(-1)) {
+		end = sb.pubseekoff(0, std::ios::end, std::ios::in);
+		sb.pubseekpos(here, std::ios::in);
+	}
+
+	for (; n > 0; --n) {
+		std::uint64_t length(0);
+		const FrameStatus status(ReadVarint(stream, length));
+		if (status != kFrameRead)
+			return status;
+
+		if (end == std::streampos(-1)) {
+			const FrameStatus ignored(IgnorePayload(stream, length));
+			if (ignored != kFrameRead)
+				return ignored;
+			continue;
+		}
+
+		const std::streampos pos(
+			sb.pubseekoff(0, std::ios::cur, std::ios::in));
+		if (length > static_cast<std::uint64_t>(end - pos)) {
+			sb.pubseekpos(end, std::ios::in);
+			stream.setstate(std::ios::eofbit);
+			return kFrameTruncated;
+		}
+		sb.pubseekoff(static_cast<std::streamoff>(length),
+			std::ios::cur, std::ios::in);
+	}
+	return kFrameRead;
+}
+
+void WriteFramedRecord(std::ostream &out, const std::string &payload)
+{
+	char buf[kMaxVarintSize];
+	out.write(buf, EncodeVarint(buf, payload.size()));
+	out.write(payload.data(), payload.size());
+}
+
+int CountFramedFields(const std::string &payload)
+{
+	const char *p(payload.data());
+	const char *const end(p + payload.size());
+	int count(0);
+	while (p != end) {
+		const char *field(NULL);
+		std::size_t length(0);
+		if (!ParseFramedField(p, end, field, length))
+			return -1;
+		++count;
+	}
+	return (count != 0) ? count : -1;
+}
+
+void AppendFramedFields(
+	std::string &payload, const std::string &line, char sep)
+{
+	const char *p(line.data());
+	const char *const end(p + line.size());
+	for (;;) {
+		const char *q(static_cast<const char *>(
+			std::memchr(p, sep, end - p)));
+		if (q == NULL)
+			q = end;
+
+		AppendVarint(payload, q - p);
+		payload.append(p, q);
+		if (q == end)
+			return;
+		p = q + 1;
+	}
+}
+
+bool AppendTextFields(
+	std::string &line, const std::string &payload, char sep)
+{
+	const char *p(payload.data());
+	const char *const end(p + payload.size());
+	for (bool first = true; p != end; first = false) {
+		const char *field(NULL);
+		std::size_t length(0);
+		if (!ParseFramedField(p, end, field, length))
+			return false;
+		if (std::memchr(field, sep, length) != NULL ||
+				std::memchr(field, '\n', length) != NULL)
+			return false;
+
+		if (!first)
+			line.push_back(sep);
+		line.append(field, length);
+	}
+	return true;
+}
+
+} // namespace rcat
@@ -0,0 +1,60 @@
+#ifndef RCAT_FRAMING_H
+#define RCAT_FRAMING_H
+
+#include <cstddef>	// size_t
+#include <cstdint>	// uint64_t
+#include <istream>
+#include <ostream>
+#include <string>
+
+namespace rcat {
+
+// A framed record is the varint length of its payload followed by the
+// payload, which is a run of fields each framed by its varint length.
+// Varints are unsigned LEB128 as in Protocol Buffers. A record has at
+// least one field, so an empty payload is malformed.
+
+void AppendVarint(std::string &s, std::uint64_t v);
+
+// Parse a field of a payload at "p" and advance "p" past it. Return
+// false if the payload is malformed.
+bool ParseFramedField(const char *&p, const char *end,
+	const char *&field, std::size_t &length);
+
+// How reading framed records went.
+enum FrameStatus {
+	kFrameRead,		// a record was read or skipped
+	kFrameEnd,		// "stream" ended before a record
+	kFrameTruncated,	// "stream" ended in the middle of a record
+	kFrameMalformed,	// a varint is longer than 64 bits
+};
+
+// Describe a status other than kFrameRead and kFrameEnd.
+const char *FrameStatusMessage(FrameStatus status);
+
+// Read the payload of a framed record. The payload grows as its bytes
+// arrive rather than to the length its header claims, so that a corrupt
+// header costs no more memory than "stream" has.
+FrameStatus ReadFramedRecord(std::istream &stream, std::string &payload);
+
+// Skip "n" framed records, seeking over their payloads if "stream" can.
+// Return kFrameEnd if fewer than "n" records were left.
+FrameStatus SkipFramedRecords(std::istream &stream, std::uint64_t n);
+
+void WriteFramedRecord(std::ostream &out, const std::string &payload);
+
+// Count fields of a payload, or return -1 if it is malformed.
+int CountFramedFields(const std::string &payload);
+
+// Append text fields separated by "sep" as framed ones to "payload".
+void AppendFramedFields(
+	std::string &payload, const std::string &line, char sep);
+
+// Append framed fields as text ones separated by "sep" to "line". Return
+// false if a field has "sep" or a record separator in it.
+bool AppendTextFields(
+	std::string &line, const std::string &payload, char sep);
+
+} // namespace rcat
+
+#endif // RCAT_FRAMING_H
@@ -0,0 +1,210 @@
+#include "parallel_gzip.h"
+
+#include <algorithm>	// max, min
+#include <cstring>	// memcpy
+
+#include <zlib.h>
+
+namespace rcat {
+
+// gzip wrapper instead of zlib one
+static const int kGzipWindowBits(15 + 16);
+static const int kMemLevel(8);
+
+ParallelGzipBuf::ParallelGzipBuf(
+	std::ostream &sink, unsigned nr_threads, std::size_t block_size)
+	: sink_(sink),
+	  block_size_(std::max<std::size_t>(block_size, 1)),
+	  max_pending_(2 * std::max(nr_threads, 1u)),
+	  current_(),
+	  empty_(true),
+	  failed_(false),
+	  pending_(),
+	  queue_(),
+	  stopping_(false),
+	  mutex_(),
+	  cond_queued_(),
+	  cond_done_(),
+	  workers_()
+{
+	for (unsigned i = 0; i < std::max(nr_threads, 1u); ++i)
+		workers_.emplace_back(&ParallelGzipBuf::Work, this);
+	StartBlock();
+}
+
+ParallelGzipBuf::~ParallelGzipBuf()
+{
+	Finish();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cond_queued_.notify_all();
+	for (std::thread &worker : workers_)
+		worker.join();
+}
+
+bool ParallelGzipBuf::Finish()
+{
+	// an empty gzip stream still needs a member
+	if (empty_) {
+		SubmitBlock();
+		StartBlock();
+	}
+	return sync() == 0;
+}
+
+ParallelGzipBuf::int_type ParallelGzipBuf::overflow(int_type c)
+{
+	SubmitBlock();
+	if (!WriteBlocks(max_pending_))
+		return traits_type::eof();
+
+	StartBlock();
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+std::streamsize ParallelGzipBuf::xsputn(const char *s, std::streamsize n)
+{
+	std::streamsize written(0);
+	while (written < n) {
+		if (pptr() == epptr() &&
+				traits_type::eq_int_type(
+					overflow(traits_type::eof()),
+					traits_type::eof()))
+			break;
+
+		const std::streamsize len(std::min<std::streamsize>(
+			n - written, epptr() - pptr()));
+		std::memcpy(pptr(), s + written, len);
+		pbump(static_cast<int>(len)); // no more than a block
+		written += len;
+	}
+	return written;
+}
+
+int ParallelGzipBuf::sync()
+{
+	if (pptr() != pbase()) {
+		SubmitBlock();
+		StartBlock();
+	}
+
+	if (!WriteBlocks(0))
+		return -1;
+
+	sink_.flush();
+	return sink_.fail() ? -1 : 0;
+}
+
+void ParallelGzipBuf::StartBlock()
+{
+	current_.reset(new Block());
+	current_->in.resize(block_size_);
+	current_->done = false;
+	current_->failed = false;
+
+	char *const p(&current_->in[0]);
+	setp(p, p + block_size_);
+}
+
+void ParallelGzipBuf::SubmitBlock()
+{
+	current_->in.resize(pptr() - pbase());
+	setp(NULL, NULL);
+
+	empty_ = false;
+
+	Block *const block(current_.get());
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_.push_back(std::move(current_));
+		queue_.push_back(block);
+	}
+	cond_queued_.notify_one();
+}
+
+// Write compressed blocks in order until at most "max_pending" ones are
+// left, waiting for them to be compressed.
+bool ParallelGzipBuf::WriteBlocks(std::size_t max_pending)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!pending_.empty()) {
+		Block &front(*pending_.front());
+		if (!front.done) {
+			if (pending_.size() <= max_pending)
+				break;
+			cond_done_.wait(lock);
+			continue;
+		}
+
+		std::unique_ptr<Block> block(std::move(pending_.front()));
+		pending_.pop_front();
+		lock.unlock();
+
+		if (block->failed || failed_) {
+			failed_ = true;
+		} else {
+			sink_.write(block->out.data(), block->out.size());
+			failed_ = sink_.fail();
+		}
+
+		lock.lock();
+	}
+	return !failed_;
+}
+
+void ParallelGzipBuf::Work()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		while (queue_.empty() && !stopping_)
+			cond_queued_.wait(lock);
+		if (queue_.empty())
+			return;
+
+		Block *const block(queue_.front());
+		queue_.pop_front();
+		lock.unlock();
+
+		const bool ok(Compress(block->in, block->out));
+
+		lock.lock();
+		block->failed = !ok;
+		block->done = true;
+		cond_done_.notify_all();
+	}
+}
+
+// Compress "in" into "out" as a complete gzip member.
+bool ParallelGzipBuf::Compress(const std::string &in, std::string &out)
+{
+	z_stream z;
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			kGzipWindowBits, kMemLevel,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	// deflateBound() does not count the gzip header and trailer
+	out.resize(deflateBound(&z, in.size()) + 32);
+	z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+	z.avail_in = static_cast<uInt>(in.size());
+	z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+	z.avail_out = static_cast<uInt>(out.size());
+
+	const int ret(deflate(&z, Z_FINISH));
+	out.resize(z.total_out);
+	deflateEnd(&z);
+	return (ret == Z_STREAM_END);
+}
+
+} // namespace rcat
@@ -0,0 +1,76 @@
+#ifndef RCAT_PARALLEL_GZIP_H
+#define RCAT_PARALLEL_GZIP_H
+
+#include <condition_variable>
+#include <cstddef>	// size_t
+#include <deque>
+#include <memory>	// unique_ptr
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rcat {
+
+// An output stream buffer which compresses what is written to it in
+// independent blocks on a pool of threads, and writes each block to
+// "sink" as a gzip member in the order they were written. Concatenated
+// members make a valid gzip stream as pigz(1) does.
+class ParallelGzipBuf : public std::streambuf {
+public:
+	static const std::size_t kDefaultBlockSize = 128 * 1024;
+
+	ParallelGzipBuf(std::ostream &sink, unsigned nr_threads,
+		std::size_t block_size = kDefaultBlockSize);
+	~ParallelGzipBuf();
+
+	// Write what is left to "sink", with the member an empty stream still
+	// needs, and flush it. Returns false if anything failed to be
+	// written.
+	bool Finish();
+
+	ParallelGzipBuf(const ParallelGzipBuf &) = delete;
+	ParallelGzipBuf &operator=(const ParallelGzipBuf &) = delete;
+
+protected:
+	int_type overflow(int_type c) override;
+	std::streamsize xsputn(const char *s, std::streamsize n) override;
+	int sync() override;
+
+private:
+	struct Block {
+		std::string in;
+		std::string out;
+		bool done;
+		bool failed;
+	};
+
+	void StartBlock();
+	void SubmitBlock();
+	bool WriteBlocks(std::size_t max_pending);
+	void Work();
+
+	static bool Compress(const std::string &in, std::string &out);
+
+	std::ostream &sink_;
+	const std::size_t block_size_;
+	const std::size_t max_pending_;
+	std::unique_ptr<Block> current_;
+	bool empty_;
+	bool failed_;
+
+	// blocks in the order they were written, and ones to be compressed
+	std::deque<std::unique_ptr<Block>> pending_;
+	std::deque<Block *> queue_;
+	bool stopping_;
+	std::mutex mutex_;
+	std::condition_variable cond_queued_;
+	std::condition_variable cond_done_;
+	std::vector<std::thread> workers_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_PARALLEL_GZIP_H
@@ -1,28 +1,196 @@
 #include <algorithm>	// count
-#include <cstdlib>	// exit
+#include <cerrno>	// errno
+#include <cstdint>	// uint64_t
+#include <cstdlib>	// atexit, exit, getenv, mkstemp, strtoull, strtod
+#include <cstring>	// memchr
 #include <fstream>	// ifstream
 #include <iostream>
+#include <limits>	// numeric_limits
+#include <map>
+#include <memory>	// unique_ptr
 #include <numeric>	// accmulate
+#include <random>	// mt19937_64, geometric_distribution
 #include <string>
+#include <thread>	// hardware_concurrency
 #include <vector>
 
-#include <unistd.h>	// getopt
+#include <getopt.h>	// getopt_long
+#include <sys/resource.h>	// getrlimit
+#include <sys/stat.h>	// stat, S_ISREG
+#include <unistd.h>	// close, unlink
+
+#include "aggregate.h"
+#include "batch_reader.h"
+#include "follow.h"
+#include "framing.h"
+#include "parallel_gzip.h"
+#include "record_sink.h"
+#include "sort.h"
+#include "utf8.h"
 
 namespace rcat {
 
 static const char kRecordSeparator('\n');
 
+static const std::size_t kScanBufferSize(1 << 16);
+static const std::uint64_t kScanThreshold(1024);
+static const std::size_t kMinOpenFiles(2);
+
 static char gFieldSeparator('\t');
 
+// body records to skip, to emit at most, and the ratio of them to sample
+static std::uint64_t gSkipRecords(0);
+static std::uint64_t gLimitRecords(std::numeric_limits<std::uint64_t>::max());
+static double gSampleRate(1.0);
+static std::uint64_t gSampleSeed(0);
+
+// files to be open at once; 0 means to derive it from RLIMIT_NOFILE
+static std::size_t gMaxOpenFiles(0);
+
+// compress output with gzip; threads to do it, 0 means as many as cores
+static bool gGzip(false);
+static unsigned gThreads(0);
+
+// field widths of fixed-width files by their 1-origin argument index
+static std::map<std::size_t, std::vector<std::size_t>> gFixedWidths;
+
+// what to do with records which are not valid UTF-8
+enum Utf8Mode {
+	kUtf8Ignore,
+	kUtf8Check,
+	kUtf8Replace,
+};
+
+static Utf8Mode gUtf8Mode(kUtf8Ignore);
+
+// read and write length-prefixed binary records instead of text ones
+static bool gFramedInput(false);
+static bool gFramedOutput(false);
+
+// aggregate joined records grouped by a 1-origin column, if any
+static bool gAggregate(false);
+static std::size_t gGroupByColumn(0);
+static std::vector<Aggregation> gAggregations;
+
+// read and validate each file on a thread of its own
+static bool gParallelValidation(false);
+
+// keep reading files as they grow, as tail -f does
+static bool gFollow(false);
+
+// sort joined records by a 1-origin column, if any, in so much memory
+static std::size_t gSortColumn(0);
+static std::size_t gSortMemory(Sorter::kDefaultMemoryLimit);
+
+enum LongOption {
+	kOptionSkip = 0x100,
+	kOptionLimit,
+	kOptionSample,
+	kOptionSeed,
+	kOptionMaxOpen,
+	kOptionThreads,
+	kOptionUtf8,
+	kOptionFramedInput,
+	kOptionFramedOutput,
+	kOptionGroupBy,
+	kOptionAggregate,
+	kOptionParallelValidation,
+	kOptionFollow,
+	kOptionSort,
+	kOptionSortMemory,
+};
+
 static inline bool IsSingleCharString(const char *s)
 {
 	return (s != NULL && s[0] != '\0' && s[1] == '\0');
 }
 
+static std::uint64_t ParseUnsigned(const char *s)
+{
+	if (s == NULL || s[0] < '0' || s[0] > '9')
+		std::exit(1);
+
+	char *end(NULL);
+	errno = 0;
+	const unsigned long long n(std::strtoull(s, &end, 10));
+	if (errno != 0 || *end != '\0')
+		std::exit(1);
+
+	return n;
+}
+
+// Parse "INDEX:WIDTH,WIDTH,..." for a fixed-width file.
+static void ParseFixedWidth(const char *s)
+{
+	if (s == NULL)
+		std::exit(1);
+
+	const char *const colon(std::strchr(s, ':'));
+	if (colon == NULL)
+		std::exit(1);
+
+	const std::uint64_t index(ParseUnsigned(
+		std::string(s, colon).c_str()));
+	if (index == 0)
+		std::exit(1);
+
+	std::vector<std::size_t> widths;
+	const char *p(colon + 1);
+	for (;;) {
+		const char *const comma(std::strchr(p, ','));
+		const std::string width(
+			p, comma != NULL ? comma : p + std::strlen(p));
+		widths.push_back(ParseUnsigned(width.c_str()));
+		if (widths.back() == 0)
+			std::exit(1);
+		if (comma == NULL)
+			break;
+		p = comma + 1;
+	}
+
+	gFixedWidths[index] = widths;
+}
+
+static double ParseRate(const char *s)
+{
+	if (s == NULL || s[0] == '\0')
+		std::exit(1);
+
+	char *end(NULL);
+	errno = 0;
+	const double r(std::strtod(s, &end));
+	if (errno != 0 || *end != '\0' || !(0.0 < r && r <= 1.0))
+		std::exit(1);
+
+	return r;
+}
+
 static std::vector<std::string> ParseOption(int argc, char **argv)
 {
+	static const struct option kLongOptions[] = {
+		{ "skip",   required_argument, NULL, kOptionSkip },
+		{ "limit",  required_argument, NULL, kOptionLimit },
+		{ "sample", required_argument, NULL, kOptionSample },
+		{ "seed",   required_argument, NULL, kOptionSeed },
+		{ "max-open", required_argument, NULL, kOptionMaxOpen },
+		{ "gzip",   no_argument,       NULL, 'z' },
+		{ "fixed-width", required_argument, NULL, 'w' },
+		{ "threads", required_argument, NULL, kOptionThreads },
+		{ "utf8",   required_argument, NULL, kOptionUtf8 },
+		{ "framed-input", no_argument, NULL, kOptionFramedInput },
+		{ "framed-output", no_argument, NULL, kOptionFramedOutput },
+		{ "group-by", required_argument, NULL, kOptionGroupBy },
+		{ "aggregate", required_argument, NULL, kOptionAggregate },
+		{ "parallel-validation", no_argument, NULL,
+			kOptionParallelValidation },
+		{ "follow", no_argument, NULL, kOptionFollow },
+		{ "sort",   required_argument, NULL, kOptionSort },
+		{ "sort-memory", required_argument, NULL, kOptionSortMemory },
+		{ NULL, 0, NULL, 0 },
+	};
+
 	int c(-1);
-	while ((c = ::getopt(argc, argv, "d:")) != -1) {
+	while ((c = ::getopt_long(argc, argv, "d:w:z", kLongOptions, NULL)) != -1) {
 		switch (c) {
 		case 'd': // field separator
 			if (!IsSingleCharString(::optarg)) {
@@ -30,6 +198,73 @@ static std::vector<std::string> ParseOption(int argc, char **argv)
 			}
 			gFieldSeparator = ::optarg[0];
 			break;
+		case 'w': // field widths of a fixed-width file
+			ParseFixedWidth(::optarg);
+			break;
+		case 'z': // compress output
+			gGzip = true;
+			break;
+		case kOptionSkip: // body records to skip
+			gSkipRecords = ParseUnsigned(::optarg);
+			break;
+		case kOptionLimit: // body records to emit at most
+			gLimitRecords = ParseUnsigned(::optarg);
+			break;
+		case kOptionSample: // ratio of body records to emit, in (0, 1]
+			gSampleRate = ParseRate(::optarg);
+			break;
+		case kOptionSeed: // seed for --sample
+			gSampleSeed = ParseUnsigned(::optarg);
+			break;
+		case kOptionMaxOpen: // files to be open at once
+			gMaxOpenFiles = ParseUnsigned(::optarg);
+			if (gMaxOpenFiles < kMinOpenFiles)
+				std::exit(1);
+			break;
+		case kOptionThreads: // threads to compress output
+			gThreads = ParseUnsigned(::optarg);
+			if (gThreads == 0)
+				std::exit(1);
+			break;
+		case kOptionUtf8: // validate records as UTF-8
+			if (std::strcmp(::optarg, "check") == 0)
+				gUtf8Mode = kUtf8Check;
+			else if (std::strcmp(::optarg, "replace") == 0)
+				gUtf8Mode = kUtf8Replace;
+			else
+				std::exit(1);
+			break;
+		case kOptionFramedInput: // read framed records
+			gFramedInput = true;
+			break;
+		case kOptionFramedOutput: // write framed records
+			gFramedOutput = true;
+			break;
+		case kOptionGroupBy: // column to group records by
+			gAggregate = true;
+			gGroupByColumn = ParseUnsigned(::optarg);
+			if (gGroupByColumn == 0)
+				std::exit(1);
+			break;
+		case kOptionAggregate: // aggregate functions
+			gAggregate = true;
+			if (!ParseAggregations(::optarg, gAggregations))
+				std::exit(1);
+			break;
+		case kOptionParallelValidation: // validate files in parallel
+			gParallelValidation = true;
+			break;
+		case kOptionFollow: // follow growing files
+			gFollow = true;
+			break;
+		case kOptionSort: // column to sort records by
+			gSortColumn = ParseUnsigned(::optarg);
+			if (gSortColumn == 0)
+				std::exit(1);
+			break;
+		case kOptionSortMemory: // bytes to sort records in
+			gSortMemory = ParseUnsigned(::optarg);
+			break;
 		default:
 			std::exit(1);
 		}
@@ -38,6 +273,32 @@ static std::vector<std::string> ParseOption(int argc, char **argv)
 	return std::vector<std::string>(&argv[optind], &argv[argc]);
 }
 
+// An input file, whether its records are framed, and offsets of its
+// fields if they are of fixed width. The last offset is the end of a
+// record.
+struct Input {
+	std::string path;
+	bool framed;
+	std::vector<std::size_t> offsets;
+};
+
+// An input file being read. A line read from it is the payload of a
+// record if framed, or delimited fields otherwise.
+struct Source {
+	std::ifstream stream;
+	const std::string &path;
+	const bool framed;
+	const std::vector<std::size_t> &offsets;
+	std::string raw; // a fixed-width record
+
+	explicit Source(const Input &input)
+		: stream(input.path, std::ios::in | std::ios::binary),
+		  path(input.path), framed(input.framed),
+		  offsets(input.offsets), raw() {}
+
+	bool fixed_width() const { return !offsets.empty(); }
+};
+
 static inline bool ReachingBlankLineEof(
 	std::istream &stream, std::string &line)
 {
@@ -45,6 +306,84 @@ static inline bool ReachingBlankLineEof(
 	return (stream.eof() && line.empty());
 }
 
+// Convert a fixed-width record into delimited fields by slicing it at
+// "offsets", without spaces padding each field. The last field may be
+// shorter than its width. Return false if "raw" does not fit them.
+static bool SliceFixedWidth(
+	const std::string &raw, const std::vector<std::size_t> &offsets,
+	std::string &line)
+{
+	const std::size_t nr_fields(offsets.size() - 1);
+	if (raw.size() < offsets[nr_fields - 1] ||
+			raw.size() > offsets[nr_fields] ||
+			std::memchr(raw.data(), gFieldSeparator, raw.size()))
+		return false;
+
+	line.resize(raw.size() + nr_fields - 1);
+	char *out(&line[0]);
+	for (std::size_t i = 0; i < nr_fields; ++i) {
+		const char *begin(raw.data() + offsets[i]);
+		const char *end(raw.data() +
+			std::min(offsets[i + 1], raw.size()));
+		while (begin != end && begin[0] == ' ')
+			++begin;
+		while (end != begin && end[-1] == ' ')
+			--end;
+
+		if (i != 0)
+			*out++ = gFieldSeparator;
+		std::memcpy(out, begin, end - begin);
+		out += end - begin;
+	}
+	line.resize(out - line.data());
+	return true;
+}
+
+// why a record cannot be joined, to be reported with the path of its file
+static const char kInvalidUtf8[] = "invalid UTF-8";
+static const char kMalformedRecord[] = "malformed framed record";
+static const char kMisalignedRecord[] = "misaligned fixed-width record";
+
+static void RecordError(const Source &file, const char *error)
+{
+	std::cerr << error << " in " << file.path << std::endl;
+	exit(1);
+}
+
+// Read a record of "source" into "line". Return false at the end, with
+// "error" set if the file ends with a broken record, or true with "error"
+// set if the record read cannot be joined. Nothing is reported here, so
+// that records read ahead on another thread fail only if they are used.
+static bool ReadRecord(Source &source, std::string &line, const char *&error)
+{
+	if (source.framed) {
+		const FrameStatus status(
+			ReadFramedRecord(source.stream, line));
+		if (status != kFrameRead && status != kFrameEnd)
+			error = FrameStatusMessage(status);
+		return (status == kFrameRead);
+	}
+
+	if (!source.fixed_width())
+		return !ReachingBlankLineEof(source.stream, line);
+
+	if (ReachingBlankLineEof(source.stream, source.raw))
+		return false;
+
+	if (!SliceFixedWidth(source.raw, source.offsets, line))
+		error = kMisalignedRecord;
+	return true;
+}
+
+static inline bool ReachingBlankLineEof(Source &source, std::string &line)
+{
+	const char *error(NULL);
+	const bool read(ReadRecord(source, line, error));
+	if (error != NULL)
+		RecordError(source, error);
+	return !read;
+}
+
 static inline int CountFieldSeparator(const std::string &s)
 {
 	//XXX is this cast really safe?
@@ -52,10 +391,87 @@ static inline int CountFieldSeparator(const std::string &s)
 		std::count(s.begin(), s.end(), gFieldSeparator));
 }
 
-static inline bool AllEndOfFile(const std::vector<std::ifstream> &files)
+// Count fields of a framed record less one, validating each of them as
+// UTF-8 if requested.
+static int ScanFramedRecord(std::string &line, const char *&error)
+{
+	const int nr_fields(CountFramedFields(line));
+	if (nr_fields < 0) {
+		error = kMalformedRecord;
+		return 0;
+	}
+	if (gUtf8Mode == kUtf8Ignore)
+		return nr_fields - 1;
+
+	std::string replaced;
+	const char *p(line.data());
+	const char *const end(p + line.size());
+	const char *field(NULL);
+	std::size_t length(0);
+	while (ParseFramedField(p, end, field, length)) {
+		std::size_t invalid(kValidUtf8);
+		CountAndValidateUtf8(field, length, gFieldSeparator, invalid);
+		if (invalid != kValidUtf8 && gUtf8Mode == kUtf8Check) {
+			error = kInvalidUtf8;
+			return 0;
+		}
+
+		std::string s(field, length);
+		if (invalid != kValidUtf8)
+			ReplaceInvalidUtf8(s, invalid);
+		AppendVarint(replaced, s.size());
+		replaced.append(s);
+	}
+	if (gUtf8Mode == kUtf8Replace)
+		line.swap(replaced);
+
+	return nr_fields - 1;
+}
+
+// Count field separators of a record, validating it as UTF-8 in the
+// same pass if requested. Invalid sequences are either rejected or
+// replaced with U+FFFD. "error" is set instead if the record is rejected.
+static int ScanRecord(
+	const Source &file, std::string &line, const char *&error)
+{
+	if (file.framed)
+		return ScanFramedRecord(line, error);
+
+	if (gUtf8Mode == kUtf8Ignore) {
+		// a sliced record has as many fields as its header
+		if (file.fixed_width())
+			return static_cast<int>(file.offsets.size() - 2);
+		return CountFieldSeparator(line);
+	}
+
+	std::size_t invalid(kValidUtf8);
+	const std::size_t count(CountAndValidateUtf8(
+		line.data(), line.size(), gFieldSeparator, invalid));
+	if (invalid != kValidUtf8) {
+		if (gUtf8Mode == kUtf8Check) {
+			error = kInvalidUtf8;
+			return 0;
+		}
+		ReplaceInvalidUtf8(line, invalid);
+	}
+
+	//XXX is this cast really safe?
+	return static_cast<int>(count);
+}
+
+static inline int ScanRecord(const Source &file, std::string &line)
+{
+	const char *error(NULL);
+	const int nr_seps(ScanRecord(file, line, error));
+	if (error != NULL)
+		RecordError(file, error);
+	return nr_seps;
+}
+
+static inline bool AllEndOfFile(const std::vector<Source> &files)
 {
 	return std::all_of(files.begin(), files.end(),
-		[](const std::ifstream &file) { return file.eof(); });
+		[](const Source &file) { return file.stream.eof(); });
 }
 
 template <class InputIterator, class T,
@@ -75,9 +491,42 @@ static T Join(
 	return init;
 }
 
+// Records being joined are either text or the payload of a framed one,
+// as "framed" tells.
+
+static inline void AppendFieldSeparator(std::string &record, bool framed)
+{
+	if (!framed)
+		record.append(1, gFieldSeparator);
+}
+
+static inline void AppendEmptyFields(
+	std::string &record, int nr_seps, bool framed)
+{
+	if (framed)
+		record.append(nr_seps + 1, '\0'); // zero-length fields
+	else
+		record.append(nr_seps, gFieldSeparator);
+}
+
+static void AppendLine(
+	std::string &record, const Source &file, const std::string &line,
+	bool framed)
+{
+	if (file.framed == framed) {
+		record.append(line);
+	} else if (framed) {
+		AppendFramedFields(record, line, gFieldSeparator);
+	} else if (!AppendTextFields(record, line, gFieldSeparator)) {
+		std::cerr << "unrepresentable field in " << file.path
+			<< std::endl;
+		exit(1);
+	}
+}
+
 static bool RunHeader(
-	std::ifstream &file,
-	std::vector<int> &nr_seps, std::string &record)
+	Source &file,
+	std::vector<int> &nr_seps, std::string &record, bool framed)
 {
 	std::string line;
 	if (ReachingBlankLineEof(file, line)) {
@@ -85,68 +534,276 @@ static bool RunHeader(
 		return false;
 	}
 
-	nr_seps.push_back(CountFieldSeparator(line));
-	record.append(line);
+	nr_seps.push_back(ScanRecord(file, line));
+	AppendLine(record, file, line, framed);
 	return true;
 }
 
 static bool AnyHeaderNotEof(
-	std::vector<std::ifstream> &files,
-	std::vector<int> &nr_seps, std::string &record)
+	std::vector<Source> &files,
+	std::vector<int> &nr_seps, std::string &record, bool framed)
 {
 	return Join(files.begin(), files.end(), false,
-		[&nr_seps, &record](bool init, std::ifstream &file) {
-			return RunHeader(file, nr_seps, record) || init;
+		[&nr_seps, &record, framed](bool init, Source &file) {
+			return RunHeader(file, nr_seps, record, framed) || init;
 		},
-		[&record]() { record.append(1, gFieldSeparator); });
+		[&record, framed]() { AppendFieldSeparator(record, framed); });
 }
 
-static bool RunBody(std::ifstream &file, int nr_seps, std::string &record)
+// Skip "n" records without either materializing or validating them.
+// Many records of a seekable file are scanned for record separators
+// in large chunks and then the file is repositioned just after the
+// n-th one; otherwise ignore() them one by one.
+static void SkipRecords(std::ifstream &file, std::uint64_t n)
 {
-	if (file.eof()) {
-		record.append(nr_seps, gFieldSeparator);
+	if (n == 0 || file.eof())
+		return;
+
+	std::streampos pos(-1);
+	if (n < kScanThreshold || (pos = file.tellg()) == std::streampos(-1)) {
+		file.clear(file.rdstate() & ~std::ios::failbit);
+		while (n-- > 0 && !file.eof())
+			file.ignore(std::numeric_limits<std::streamsize>::max(),
+				kRecordSeparator);
+		return;
+	}
+
+	static std::vector<char> buf(kScanBufferSize);
+	std::streambuf &sb(*file.rdbuf());
+	for (;;) {
+		const std::streamsize len(sb.sgetn(buf.data(), buf.size()));
+		if (len <= 0) {
+			// fewer than "n" records are left
+			file.setstate(std::ios::eofbit);
+			return;
+		}
+
+		const char *p(buf.data());
+		const char *const end(p + len);
+		while (const char *q = static_cast<const char *>(
+				std::memchr(p, kRecordSeparator, end - p))) {
+			p = q + 1;
+			if (--n == 0) {
+				file.seekg(pos + std::streamoff(p - buf.data()));
+				return;
+			}
+		}
+		pos += len;
+	}
+}
+
+static void SkipRecords(Source &file, std::uint64_t n)
+{
+	if (!file.framed)
+		SkipRecords(file.stream, n);
+	else if (!file.stream.eof()) {
+		const FrameStatus status(SkipFramedRecords(file.stream, n));
+		if (status != kFrameRead && status != kFrameEnd)
+			RecordError(file, FrameStatusMessage(status));
+	}
+}
+
+static void SkipAllRecords(std::vector<Source> &files, std::uint64_t n)
+{
+	for (Source &file : files)
+		SkipRecords(file, n);
+}
+
+static bool RunBody(
+	Source &file, int nr_seps,
+	std::string &line, std::string &record, bool framed)
+{
+	if (file.stream.eof()) {
+		AppendEmptyFields(record, nr_seps, framed);
 		return false;
 	}
 
-	std::string line;
 	if(ReachingBlankLineEof(file, line)) {
-		record.append(nr_seps, gFieldSeparator);
+		AppendEmptyFields(record, nr_seps, framed);
 		return false;
 	}
 
-	if (nr_seps != CountFieldSeparator(line))
+	if (nr_seps != ScanRecord(file, line))
 		exit(1);
 
-	record.append(line);
+	AppendLine(record, file, line, framed);
 	return true;
 }
 
 static bool AnyBodyNotEof(
-	std::vector<std::ifstream> &files,
-	std::vector<int> &nr_seps, std::string &record)
+	std::vector<Source> &files, const std::vector<int> &nr_seps,
+	std::string &line, std::string &record, bool framed)
 {
-	std::size_t i(0); //XXX soooooooooooooooooo ugry
-	return Join(files.begin(), files.end(), false,
-		[&nr_seps, &record, &i](bool init, std::ifstream &file) {
-			return RunBody(file, nr_seps[i++], record) || init;
-		},
-		[&record]() { record.append(1, gFieldSeparator); });
+	bool any(false);
+	for (std::size_t i = 0; i < files.size(); ++i) {
+		if (i != 0)
+			AppendFieldSeparator(record, framed);
+		any = RunBody(files[i], nr_seps[i], line, record, framed) ||
+			any;
+	}
+	return any;
 }
 
-static int Run(const std::vector<std::string> &args)
+// Same as RunBody() but for a record read and validated by "reader". An
+// error is reported only here, as the record is used, and exits without
+// unwinding, so readers which may be blocked in reading are not joined.
+static bool RunBody(
+	BatchReader &reader, const Source &file, int nr_seps,
+	std::string &line, std::string &record, bool framed)
 {
-	const std::size_t length(args.size());
-	if (length == 0)
-		return 1;
+	int n(0);
+	const char *error(NULL);
+	const bool read(reader.Next(line, n, error));
+	if (error != NULL)
+		RecordError(file, error);
+	if (!read) {
+		AppendEmptyFields(record, nr_seps, framed);
+		return false;
+	}
+
+	if (nr_seps != n)
+		exit(1);
+
+	AppendLine(record, file, line, framed);
+	return true;
+}
+
+static bool AnyBodyNotEof(
+	std::vector<std::unique_ptr<BatchReader>> &readers,
+	const std::vector<Source> &files, const std::vector<int> &nr_seps,
+	std::string &line, std::string &record, bool framed)
+{
+	bool any(false);
+	for (std::size_t i = 0; i < readers.size(); ++i) {
+		if (i != 0)
+			AppendFieldSeparator(record, framed);
+		any = RunBody(*readers[i], files[i], nr_seps[i],
+			line, record, framed) || any;
+	}
+	return any;
+}
+
+// Which body records to emit: skip the first "skip" ones, then keep each
+// one with probability "sample" until "limit" of them are emitted.
+struct Window {
+	std::uint64_t skip;
+	std::uint64_t limit;
+	double sample;
+};
+
+static const Window kWholeWindow = {
+	0, std::numeric_limits<std::uint64_t>::max(), 1.0,
+};
+
+// Join body records, each file of which is read and validated by a
+// worker of its own in batches, leaving this thread to check how many
+// fields they have and to emit them.
+static void JoinBodyInParallel(
+	std::vector<Source> &files, const std::vector<int> &nr_seps,
+	const Window &window, RecordSink &sink)
+{
+	const bool framed(sink.framed());
+
+	// only regular files are read ahead, as a worker blocked reading a
+	// pipe could not be joined until it has more records or ends
+	std::vector<std::unique_ptr<BatchReader>> readers;
+	readers.reserve(files.size());
+	for (Source &file : files) {
+		struct stat st;
+		const bool regular(::stat(file.path.c_str(), &st) == 0 &&
+			S_ISREG(st.st_mode));
+		readers.emplace_back(new BatchReader(
+			[&file](std::string &line, int &nr_seps,
+					const char *&error) {
+				if (file.stream.eof() ||
+						!ReadRecord(file, line, error))
+					return false;
+				if (error == NULL)
+					nr_seps = ScanRecord(file, line, error);
+				return true;
+			}, regular));
+	}
+
+	const bool sampling(window.sample < 1.0);
+	std::mt19937_64 engine(gSampleSeed);
+	std::geometric_distribution<std::uint64_t> gap(window.sample);
+
+	const auto all_at_end = [&readers]() {
+		return std::all_of(readers.begin(), readers.end(),
+			[](const std::unique_ptr<BatchReader> &reader) {
+				return reader->AtEnd();
+			});
+	};
+
+	std::uint64_t nr_records(0);
+	std::string line, record;
+	while (nr_records < window.limit && !all_at_end()) {
+		if (sampling) {
+			const std::uint64_t n(gap(engine));
+			for (auto &reader : readers)
+				reader->Skip(n);
+		}
+
+		record.clear();
+		if (AnyBodyNotEof(readers, files, nr_seps, line, record,
+				framed)) {
+			sink.Body(record);
+			++nr_records;
+		}
+	}
+}
+
+// Join body records of exactly two files, the most common case. Unlike
+// the general loop, both cursors are advanced in place, without going
+// through vectors of files and of their numbers of fields per row.
+static void JoinBodyOfTwo(
+	Source &first, Source &second, int first_seps, int second_seps,
+	const Window &window, RecordSink &sink)
+{
+	const bool framed(sink.framed());
+
+	const bool sampling(window.sample < 1.0);
+	std::mt19937_64 engine(gSampleSeed);
+	std::geometric_distribution<std::uint64_t> gap(window.sample);
+
+	std::uint64_t nr_records(0);
+	std::string line, record;
+	while (nr_records < window.limit &&
+			!(first.stream.eof() && second.stream.eof())) {
+		if (sampling) {
+			const std::uint64_t n(gap(engine));
+			SkipRecords(first, n);
+			SkipRecords(second, n);
+		}
+
+		record.clear();
+		bool any(RunBody(first, first_seps, line, record, framed));
+		AppendFieldSeparator(record, framed);
+		any = RunBody(second, second_seps, line, record, framed) ||
+			any;
+		if (any) {
+			sink.Body(record);
+			++nr_records;
+		}
+	}
+}
+
+static void JoinFiles(
+	const std::vector<Input> &inputs,
+	const Window &window, RecordSink &sink)
+{
+	const std::size_t length(inputs.size());
+	const bool framed(sink.framed());
 
 	// 1) open files
-	std::vector<std::ifstream> files;
+	std::vector<Source> files;
 	files.reserve(length);
-	std::for_each(args.cbegin(), args.cend(),
-		[&files](const std::string &arg) {
-			files.emplace_back(arg);
-			if (files.crbegin()->fail()) {
-				std::cerr << "cannot open " << arg << std::endl;
+	std::for_each(inputs.cbegin(), inputs.cend(),
+		[&files](const Input &input) {
+			files.emplace_back(input);
+			if (files.crbegin()->stream.fail()) {
+				std::cerr << "cannot open " << input.path
+					<< std::endl;
 				exit(1);
 			}
 		});
@@ -156,18 +813,343 @@ static int Run(const std::vector<std::string> &args)
 	nr_seps.reserve(length);
 	{
 		std::string record;
-		if (AnyHeaderNotEof(files, nr_seps, record))
-			std::cout << record << kRecordSeparator;
+		if (AnyHeaderNotEof(files, nr_seps, record, framed))
+			sink.Header(record);
 	}
 
 	// 3) read body
-	while (!AllEndOfFile(files)) {
-		std::string record;
-		if (AnyBodyNotEof(files, nr_seps, record))
-			std::cout << record << kRecordSeparator;
+	SkipAllRecords(files, window.skip);
+
+	if (gParallelValidation) {
+		JoinBodyInParallel(files, nr_seps, window, sink);
+		return;
+	}
+
+#ifndef RCAT_GENERIC_JOIN
+	if (length == 2) {
+		JoinBodyOfTwo(files[0], files[1], nr_seps[0], nr_seps[1],
+			window, sink);
+		return;
+	}
+#endif
+
+	const bool sampling(window.sample < 1.0);
+	std::mt19937_64 engine(gSampleSeed);
+	std::geometric_distribution<std::uint64_t> gap(window.sample);
+
+	// buffers of a line and a record are reused across rows
+	std::uint64_t nr_records(0);
+	std::string line, record;
+	while (nr_records < window.limit && !AllEndOfFile(files)) {
+		if (sampling)
+			SkipAllRecords(files, gap(engine));
+
+		record.clear();
+		if (AnyBodyNotEof(files, nr_seps, line, record, framed)) {
+			sink.Body(record);
+			++nr_records;
+		}
+	}
+}
+
+// Read a complete record of a followed file into "line", sleeping until
+// it is written. Return false if the file ends, which only files other
+// than regular ones do, such as pipes.
+static bool FollowRecord(
+	Source &file, bool regular, FileWatcher &watcher, std::string &line)
+{
+	std::string &whole(file.fixed_width() ? file.raw : line);
+	std::string chunk;
+	whole.clear();
+	for (;;) {
+		std::getline(file.stream, chunk, kRecordSeparator);
+		whole.append(chunk);
+		if (!file.stream.eof())
+			break;
+
+		// the last record of a file which has ended may be incomplete
+		if (!regular) {
+			if (whole.empty())
+				return false;
+			break;
+		}
+
+		file.stream.clear();
+		watcher.Wait();
+	}
+
+	if (file.fixed_width() &&
+			!SliceFixedWidth(file.raw, file.offsets, line))
+		RecordError(file, kMisalignedRecord);
+	return true;
+}
+
+// Join records of files being written, emitting each of them as soon as
+// all files have a complete record for it, until any of them ends. Since
+// no file is known to be at its end, missing records are never padded.
+static void FollowFiles(
+	const std::vector<Input> &inputs,
+	const Window &window, RecordSink &sink)
+{
+	const bool framed(sink.framed());
+
+	std::vector<Source> files;
+	std::vector<bool> regular;
+	files.reserve(inputs.size());
+	FileWatcher watcher;
+	for (const Input &input : inputs) {
+		files.emplace_back(input);
+		struct stat st;
+		if (files.back().stream.fail() ||
+				::stat(input.path.c_str(), &st) != 0) {
+			std::cerr << "cannot open " << input.path << std::endl;
+			exit(1);
+		}
+		regular.push_back(S_ISREG(st.st_mode));
+		if (regular.back())
+			watcher.Watch(input.path);
 	}
 
-	return 0;
+	std::string line, record;
+	const auto skip_records = [&](std::uint64_t n) {
+		for (; n > 0; --n) {
+			for (std::size_t i = 0; i < files.size(); ++i) {
+				if (!FollowRecord(files[i], regular[i], watcher,
+						line))
+					return false;
+			}
+		}
+		return true;
+	};
+
+	// read header
+	std::vector<int> nr_seps;
+	for (std::size_t i = 0; i < files.size(); ++i) {
+		if (!FollowRecord(files[i], regular[i], watcher, line))
+			return;
+		if (i != 0)
+			AppendFieldSeparator(record, framed);
+		nr_seps.push_back(ScanRecord(files[i], line));
+		AppendLine(record, files[i], line, framed);
+	}
+	sink.Header(record);
+	sink.Flush();
+
+	// read body
+	if (!skip_records(window.skip))
+		return;
+
+	const bool sampling(window.sample < 1.0);
+	std::mt19937_64 engine(gSampleSeed);
+	std::geometric_distribution<std::uint64_t> gap(window.sample);
+
+	for (std::uint64_t nr_records = 0; nr_records < window.limit;
+			++nr_records) {
+		if (sampling && !skip_records(gap(engine)))
+			return;
+
+		record.clear();
+		for (std::size_t i = 0; i < files.size(); ++i) {
+			if (!FollowRecord(files[i], regular[i], watcher, line))
+				return;
+			if (nr_seps[i] != ScanRecord(files[i], line))
+				exit(1);
+			if (i != 0)
+				AppendFieldSeparator(record, framed);
+			AppendLine(record, files[i], line, framed);
+		}
+		sink.Body(record);
+		sink.Flush();
+	}
+}
+
+static std::vector<std::string> gTemporaryFiles;
+
+static void RemoveTemporaryFiles()
+{
+	for (const std::string &path : gTemporaryFiles)
+		::unlink(path.c_str());
+	gTemporaryFiles.clear();
+}
+
+static void RemoveTemporaryFile(const Input &input)
+{
+	::unlink(input.path.c_str());
+	gTemporaryFiles.erase(std::remove(
+		gTemporaryFiles.begin(), gTemporaryFiles.end(), input.path),
+		gTemporaryFiles.end());
+}
+
+// Create an empty temporary file which is removed at exit.
+static std::string MakeTemporaryFile()
+{
+	const char *const dir(std::getenv("TMPDIR"));
+	std::string path((dir != NULL && dir[0] != '\0') ? dir : "/tmp");
+	path.append("/rcat.XXXXXX");
+
+	const int fd(::mkstemp(&path[0]));
+	if (fd == -1) {
+		std::cerr << "cannot create " << path << std::endl;
+		exit(1);
+	}
+	::close(fd);
+
+	if (gTemporaryFiles.empty())
+		std::atexit(RemoveTemporaryFiles);
+	gTemporaryFiles.push_back(path);
+	return path;
+}
+
+// Leave some file descriptors for stdio and temporary files.
+static std::size_t DefaultMaxOpenFiles()
+{
+	static const rlim_t kReserved(16);
+
+	struct rlimit rl;
+	if (::getrlimit(RLIMIT_NOFILE, &rl) != 0 ||
+			rl.rlim_cur == RLIM_INFINITY ||
+			rl.rlim_cur < kReserved + kMinOpenFiles)
+		return 1024 - kReserved;
+
+	return static_cast<std::size_t>(rl.rlim_cur - kReserved);
+}
+
+// Join at most "gMaxOpenFiles" files at once. If there are more, join
+// each group of them into a temporary file first, then join those.
+// Since a partial record has as many separators as its group header,
+// this emits the same records as joining all files at once.
+static void JoinGroups(
+	std::vector<Input> args,
+	const Window &window, RecordSink &sink)
+{
+	const std::size_t max_open(
+		gMaxOpenFiles != 0 ? gMaxOpenFiles : DefaultMaxOpenFiles());
+
+	if (args.size() <= max_open) {
+		JoinFiles(args, window, sink);
+		return;
+	}
+
+	// Skipping and limiting are applied once in the first pass, but
+	// sampling must see fully joined records so it is left to the last.
+	Window pass(window), last(kWholeWindow);
+	if (window.sample < 1.0) {
+		pass.limit = kWholeWindow.limit;
+		pass.sample = kWholeWindow.sample;
+		last.limit = window.limit;
+		last.sample = window.sample;
+	}
+
+	bool first_pass(true);
+	while (args.size() > max_open) {
+		std::vector<Input> partials;
+		for (auto i = args.cbegin(); i != args.cend(); ) {
+			const std::size_t n(std::min<std::size_t>(
+				max_open, args.cend() - i));
+			const std::vector<Input> group(i, i + n);
+			i += n;
+
+			// partial records are in the format of inputs
+			partials.push_back(
+				Input { MakeTemporaryFile(), gFramedInput, {} });
+			std::ofstream partial(partials.back().path,
+				std::ios::out | std::ios::binary);
+			StreamSink partial_sink(partial, gFramedInput);
+			JoinFiles(group, pass, partial_sink);
+			partial.close();
+			if (partial.fail()) {
+				std::cerr << "cannot write "
+					<< partials.back().path << std::endl;
+				exit(1);
+			}
+		}
+
+		args.swap(partials);
+		if (!first_pass)
+			std::for_each(partials.cbegin(), partials.cend(),
+				RemoveTemporaryFile);
+		first_pass = false;
+		pass = kWholeWindow;
+	}
+
+	JoinFiles(args, last, sink);
+}
+
+// Join "inputs" and write the result, or what is computed from it, to
+// "out".
+static int Output(
+	const std::vector<Input> &inputs, const Window &window,
+	std::ostream &out)
+{
+	StreamSink stream(out, gFramedOutput);
+	if (gFollow) {
+		FollowFiles(inputs, window, stream);
+		out.flush();
+		return out.fail() ? 1 : 0;
+	}
+
+	// records pass aggregation first and then sorting, if any
+	RecordSink *sink(&stream);
+	std::unique_ptr<Sorter> sorter;
+	if (gSortColumn != 0) {
+		sorter.reset(new Sorter(gSortColumn, gFieldSeparator,
+			gFramedInput, gSortMemory, MakeTemporaryFile, *sink));
+		sink = sorter.get();
+	}
+
+	std::unique_ptr<Aggregator> aggregator;
+	if (gAggregate) {
+		if (gAggregations.empty())
+			gAggregations.push_back(
+				Aggregation { Aggregation::kCount, 0 });
+
+		aggregator.reset(new Aggregator(gGroupByColumn,
+			gAggregations, gFieldSeparator, gFramedInput, *sink));
+		sink = aggregator.get();
+	}
+
+	JoinGroups(inputs, window, *sink);
+	sink->Finish();
+
+	out.flush();
+	return out.fail() ? 1 : 0;
+}
+
+static int Run(const std::vector<std::string> &args)
+{
+	if (args.empty())
+		return 1;
+
+	std::vector<Input> inputs;
+	inputs.reserve(args.size());
+	for (const std::string &arg : args)
+		inputs.push_back(Input { arg, gFramedInput, {} });
+
+	for (const auto &fixed : gFixedWidths) {
+		if (fixed.first > inputs.size() || gFramedInput)
+			return 1;
+
+		std::vector<std::size_t> &offsets(
+			inputs[fixed.first - 1].offsets);
+		offsets.push_back(0);
+		for (std::size_t width : fixed.second)
+			offsets.push_back(offsets.back() + width);
+	}
+
+	// framed records, aggregates and sorted records are not followed
+	if (gFollow && (gFramedInput || gAggregate || gSortColumn != 0))
+		return 1;
+
+	const Window window = { gSkipRecords, gLimitRecords, gSampleRate };
+	if (!gGzip)
+		return Output(inputs, window, std::cout);
+
+	const unsigned nr_threads(gThreads != 0 ? gThreads :
+		std::max(std::thread::hardware_concurrency(), 1u));
+	ParallelGzipBuf gzip(std::cout, nr_threads);
+	std::ostream out(&gzip);
+	const int status(Output(inputs, window, out));
+	return gzip.Finish() ? status : 1;
 }
 
 } // namespace rcat
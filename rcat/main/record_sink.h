@@ -0,0 +1,55 @@
+#ifndef RCAT_RECORD_SINK_H
+#define RCAT_RECORD_SINK_H
+
+#include <ostream>
+#include <string>
+
+#include "framing.h"
+
+namespace rcat {
+
+// A consumer of joined records: a header followed by body records, each
+// of which is either text without its record separator or the payload
+// of a framed record as framed() tells.
+class RecordSink {
+public:
+	virtual ~RecordSink() {}
+
+	virtual bool framed() const = 0;
+	virtual void Header(const std::string &record) = 0;
+	virtual void Body(const std::string &record) = 0;
+	virtual void Finish() {}
+
+	// Pass records received so far downstream without delay.
+	virtual void Flush() {}
+};
+
+// A sink writing records to a stream as they come.
+class StreamSink : public RecordSink {
+public:
+	StreamSink(std::ostream &out, bool framed)
+		: out_(out), framed_(framed) {}
+
+	bool framed() const override { return framed_; }
+	void Header(const std::string &record) override { Write(record); }
+	void Body(const std::string &record) override { Write(record); }
+	void Flush() override { out_.flush(); }
+
+	std::ostream &stream() { return out_; }
+
+private:
+	void Write(const std::string &record)
+	{
+		if (framed_)
+			WriteFramedRecord(out_, record);
+		else
+			out_ << record << '\n';
+	}
+
+	std::ostream &out_;
+	const bool framed_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_RECORD_SINK_H
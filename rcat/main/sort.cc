@@ -0,0 +1,293 @@
+#include "sort.h"
+
+#include <algorithm>	// min, stable_sort
+#include <cstdlib>	// exit
+#include <cstring>	// memchr, memcmp
+#include <fstream>
+#include <iostream>	// cerr
+#include <queue>	// priority_queue
+#include <utility>	// move
+
+#include <unistd.h>	// unlink
+
+#include "framing.h"
+
+namespace rcat {
+
+// runs to merge at once, leaving file descriptors for inputs
+static const std::size_t kMaxMergeRuns(64);
+
+static inline std::uint64_t KeyPrefix(const char *key, std::size_t length)
+{
+	std::uint64_t prefix(0);
+	for (std::size_t i = 0; i < 8; ++i) {
+		prefix <<= 8;
+		if (i < length)
+			prefix |= static_cast<unsigned char>(key[i]);
+	}
+	return prefix;
+}
+
+static inline int CompareKeys(
+	const char *a, std::size_t a_length,
+	const char *b, std::size_t b_length)
+{
+	const int c(std::memcmp(a, b, std::min(a_length, b_length)));
+	if (c != 0)
+		return c;
+	return (a_length < b_length) ? -1 : (a_length > b_length) ? 1 : 0;
+}
+
+Sorter::Sorter(std::size_t key_column, char field_separator, bool framed,
+	std::size_t memory_limit,
+	std::function<std::string()> make_temporary_file,
+	RecordSink &out)
+	: key_column_(key_column),
+	  separator_(field_separator),
+	  framed_(framed),
+	  memory_limit_(memory_limit),
+	  make_temporary_file_(std::move(make_temporary_file)),
+	  out_(out),
+	  records_(),
+	  entries_(),
+	  runs_()
+{
+}
+
+static void NoKeyColumn(std::size_t key_column)
+{
+	std::cerr << "no column " << key_column << " to sort by" << std::endl;
+	std::exit(1);
+}
+
+// Find the key column of a record, reusing how it is delimited.
+void Sorter::FindKey(const char *record, std::size_t length,
+	std::size_t &key_offset, std::size_t &key_length) const
+{
+	const char *p(record);
+	const char *const end(record + length);
+	if (framed_) {
+		const char *field(NULL);
+		for (std::size_t column = 1; ; ++column) {
+			if (!ParseFramedField(p, end, field, key_length))
+				NoKeyColumn(key_column_);
+			if (column == key_column_) {
+				key_offset = field - record;
+				return;
+			}
+		}
+	}
+
+	for (std::size_t column = 1; ; ++column) {
+		const char *q(static_cast<const char *>(
+			std::memchr(p, separator_, end - p)));
+		if (column == key_column_) {
+			key_offset = p - record;
+			key_length = (q != NULL ? q : end) - p;
+			return;
+		}
+		if (q == NULL)
+			NoKeyColumn(key_column_);
+		p = q + 1;
+	}
+}
+
+void Sorter::Header(const std::string &record)
+{
+	Emit(record, true);
+}
+
+void Sorter::Body(const std::string &record)
+{
+	Entry entry;
+	entry.offset = records_.size();
+	entry.length = record.size();
+	FindKey(record.data(), record.size(),
+		entry.key_offset, entry.key_length);
+	entry.prefix = KeyPrefix(record.data() + entry.key_offset,
+		entry.key_length);
+
+	records_.append(record);
+	entries_.push_back(entry);
+	if (records_.size() + entries_.size() * sizeof(Entry) >
+			memory_limit_)
+		SpillRecords();
+}
+
+// Sort records by comparing prefixes of their keys, and only the rest
+// of the keys if they are the same.
+void Sorter::SortRecords()
+{
+	const char *const base(records_.data());
+	std::stable_sort(entries_.begin(), entries_.end(),
+		[base](const Entry &a, const Entry &b) {
+			if (a.prefix != b.prefix)
+				return a.prefix < b.prefix;
+			if (a.key_length <= 8 && b.key_length <= 8)
+				return a.key_length < b.key_length;
+			return CompareKeys(
+				base + a.offset + a.key_offset, a.key_length,
+				base + b.offset + b.key_offset,
+				b.key_length) < 0;
+		});
+}
+
+// Write records sorted so far into a run, each of them framed as a
+// whole.
+void Sorter::SpillRecords()
+{
+	if (entries_.empty())
+		return;
+
+	SortRecords();
+
+	runs_.push_back(make_temporary_file_());
+	std::ofstream run(runs_.back(), std::ios::out | std::ios::binary);
+	std::string length;
+	for (const Entry &entry : entries_) {
+		length.clear();
+		AppendVarint(length, entry.length);
+		run.write(length.data(), length.size());
+		run.write(records_.data() + entry.offset, entry.length);
+	}
+	run.close();
+	if (run.fail()) {
+		std::cerr << "cannot write " << runs_.back() << std::endl;
+		std::exit(1);
+	}
+
+	records_.clear();
+	entries_.clear();
+}
+
+// Merge runs into a new one, or emit them if "last". Records of equal
+// keys are taken from earlier runs first to keep the sort stable.
+std::string Sorter::MergeRuns(
+	const std::vector<std::string> &runs, bool last)
+{
+	std::vector<std::ifstream> streams;
+	streams.reserve(runs.size());
+	for (const std::string &path : runs) {
+		streams.emplace_back(path, std::ios::in | std::ios::binary);
+		if (streams.back().fail()) {
+			std::cerr << "cannot open " << path << std::endl;
+			std::exit(1);
+		}
+	}
+
+	std::vector<Head> heads(runs.size());
+	const auto later = [&heads](std::size_t a, std::size_t b) {
+		const Head &x(heads[a]), &y(heads[b]);
+		const int c(CompareKeys(
+			x.record.data() + x.key_offset, x.key_length,
+			y.record.data() + y.key_offset, y.key_length));
+		return c != 0 ? c > 0 : x.run > y.run;
+	};
+	std::priority_queue<std::size_t, std::vector<std::size_t>,
+		decltype(later)> queue(later);
+
+	const auto advance = [this, &runs, &streams, &heads, &queue](
+			std::size_t i) {
+		Head &head(heads[i]);
+		const FrameStatus status(
+			ReadFramedRecord(streams[i], head.record));
+		if (status == kFrameEnd)
+			return;
+		if (status != kFrameRead) {
+			std::cerr << FrameStatusMessage(status) << " in "
+				<< runs[i] << std::endl;
+			std::exit(1);
+		}
+		FindKey(head.record.data(), head.record.size(),
+			head.key_offset, head.key_length);
+		queue.push(i);
+	};
+	for (std::size_t i = 0; i < runs.size(); ++i) {
+		heads[i].run = i;
+		advance(i);
+	}
+
+	std::string path;
+	std::ofstream merged;
+	if (!last) {
+		path = make_temporary_file_();
+		merged.open(path, std::ios::out | std::ios::binary);
+	}
+
+	while (!queue.empty()) {
+		const std::size_t i(queue.top());
+		queue.pop();
+		if (last)
+			Emit(heads[i].record, false);
+		else
+			WriteFramedRecord(merged, heads[i].record);
+		advance(i);
+	}
+
+	for (const std::string &run : runs)
+		::unlink(run.c_str());
+
+	if (!last) {
+		merged.close();
+		if (merged.fail()) {
+			std::cerr << "cannot write " << path << std::endl;
+			std::exit(1);
+		}
+	}
+	return path;
+}
+
+void Sorter::Finish()
+{
+	if (runs_.empty()) {
+		SortRecords();
+		for (const Entry &entry : entries_)
+			Emit(records_.substr(entry.offset, entry.length),
+				false);
+		records_.clear();
+		entries_.clear();
+	} else {
+		SpillRecords();
+
+		// merge at most "kMaxMergeRuns" runs at once, in order
+		while (runs_.size() > kMaxMergeRuns) {
+			std::vector<std::string> merged;
+			for (std::size_t i = 0; i < runs_.size();
+					i += kMaxMergeRuns) {
+				const std::size_t n(std::min(kMaxMergeRuns,
+					runs_.size() - i));
+				merged.push_back(MergeRuns(std::vector<std::string>(
+					runs_.begin() + i, runs_.begin() + i + n),
+					false));
+			}
+			runs_.swap(merged);
+		}
+		MergeRuns(runs_, true);
+		runs_.clear();
+	}
+	out_.Finish();
+}
+
+void Sorter::Emit(const std::string &record, bool header)
+{
+	const std::string *text(&record);
+	std::string converted;
+	if (out_.framed() && !framed_) {
+		AppendFramedFields(converted, record, separator_);
+		text = &converted;
+	} else if (!out_.framed() && framed_) {
+		if (!AppendTextFields(converted, record, separator_)) {
+			std::cerr << "unrepresentable field in sorted records"
+				<< std::endl;
+			std::exit(1);
+		}
+		text = &converted;
+	}
+
+	if (header)
+		out_.Header(*text);
+	else
+		out_.Body(*text);
+}
+
+} // namespace rcat
@@ -0,0 +1,77 @@
+#ifndef RCAT_SORT_H
+#define RCAT_SORT_H
+
+#include <cstddef>	// size_t
+#include <cstdint>	// uint64_t
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "record_sink.h"
+
+namespace rcat {
+
+// A sink sorting records stably by the bytes of their 1-origin
+// "key_column", as LC_ALL=C sort -s does, and passing them to "out" when
+// finished. Records are the payloads of framed ones if "framed", so that
+// fields may have "field_separator" in them, and text ones otherwise.
+// The header is passed through as is. Records are sorted in memory as
+// an array of their offsets; once they take more than "memory_limit"
+// bytes, each sorted run of them is spilled into a file made by
+// "make_temporary_file", and the runs are merged at last.
+class Sorter : public RecordSink {
+public:
+	static const std::size_t kDefaultMemoryLimit = 256 << 20;
+
+	Sorter(std::size_t key_column, char field_separator, bool framed,
+		std::size_t memory_limit,
+		std::function<std::string()> make_temporary_file,
+		RecordSink &out);
+
+	bool framed() const override { return framed_; }
+	void Header(const std::string &record) override;
+	void Body(const std::string &record) override;
+	void Finish() override;
+
+private:
+	// a record in "records_", with its key relative to it and the first
+	// bytes of the key in big endian to compare most keys at once
+	struct Entry {
+		std::uint64_t prefix;
+		std::size_t offset;
+		std::size_t length;
+		std::size_t key_offset;
+		std::size_t key_length;
+	};
+
+	// a record being merged from a run
+	struct Head {
+		std::string record;
+		std::size_t key_offset;
+		std::size_t key_length;
+		std::size_t run;
+	};
+
+	void FindKey(const char *record, std::size_t length,
+		std::size_t &key_offset, std::size_t &key_length) const;
+	void SortRecords();
+	void SpillRecords();
+	std::string MergeRuns(
+		const std::vector<std::string> &runs, bool last);
+	void Emit(const std::string &record, bool header);
+
+	const std::size_t key_column_;
+	const char separator_;
+	const bool framed_;
+	const std::size_t memory_limit_;
+	const std::function<std::string()> make_temporary_file_;
+	RecordSink &out_;
+
+	std::string records_;
+	std::vector<Entry> entries_;
+	std::vector<std::string> runs_;
+};
+
+} // namespace rcat
+
+#endif // RCAT_SORT_H
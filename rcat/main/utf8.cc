@@ -0,0 +1,144 @@
+#include "utf8.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace rcat {
+
+static const char kReplacementCharacter[] = "\xEF\xBF\xBD";
+
+// A decoder state: continuation bytes still needed and the range of the
+// next one, which is narrower than 80..BF just after some lead bytes.
+struct Utf8State {
+	unsigned need;
+	unsigned char lo;
+	unsigned char hi;
+};
+
+static const Utf8State kInitialState = { 0, 0x80, 0xBF };
+
+// Feed a byte to a decoder. Return false if it cannot continue a
+// sequence (then "state" is left as is) or cannot start one.
+static inline bool Step(Utf8State &state, unsigned char c)
+{
+	if (state.need != 0) {
+		if (c < state.lo || c > state.hi)
+			return false;
+		--state.need;
+		state.lo = 0x80;
+		state.hi = 0xBF;
+		return true;
+	}
+
+	if (c < 0x80)
+		return true;
+	if (c < 0xC2)
+		return false;
+	if (c < 0xE0) {
+		state.need = 1;
+	} else if (c < 0xF0) {
+		state.need = 2;
+		if (c == 0xE0)
+			state.lo = 0xA0; // no overlong forms
+		else if (c == 0xED)
+			state.hi = 0x9F; // no surrogates
+	} else if (c < 0xF5) {
+		state.need = 3;
+		if (c == 0xF0)
+			state.lo = 0x90; // no overlong forms
+		else if (c == 0xF4)
+			state.hi = 0x8F; // nothing beyond U+10FFFF
+	} else {
+		return false;
+	}
+	return true;
+}
+
+std::size_t CountAndValidateUtf8(
+	const char *s, std::size_t n, char sep, std::size_t &invalid)
+{
+	const unsigned char *const p(
+		reinterpret_cast<const unsigned char *>(s));
+	std::size_t count(0), i(0), start(0);
+	Utf8State state(kInitialState);
+	invalid = kValidUtf8;
+
+#ifdef __SSE2__
+	// Count separators 16 bytes at a time, and feed the decoder only
+	// with chunks having a non-ASCII byte or a pending sequence.
+	const __m128i vsep(_mm_set1_epi8(sep));
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v(_mm_loadu_si128(
+			reinterpret_cast<const __m128i *>(p + i)));
+		count += __builtin_popcount(
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, vsep)));
+
+		if (invalid != kValidUtf8 ||
+				(state.need == 0 && _mm_movemask_epi8(v) == 0))
+			continue;
+
+		for (std::size_t j = i; j < i + 16; ++j) {
+			if (state.need == 0)
+				start = j;
+			if (!Step(state, p[j])) {
+				invalid = start;
+				break;
+			}
+		}
+	}
+#endif
+
+	for (; i < n; ++i) {
+		count += (p[i] == static_cast<unsigned char>(sep));
+		if (invalid != kValidUtf8)
+			continue;
+		if (state.need == 0)
+			start = i;
+		if (!Step(state, p[i]))
+			invalid = start;
+	}
+
+	// truncated at the end
+	if (invalid == kValidUtf8 && state.need != 0)
+		invalid = start;
+
+	return count;
+}
+
+void ReplaceInvalidUtf8(std::string &s, std::size_t from)
+{
+	std::string out(s, 0, from);
+	out.reserve(s.size() + sizeof(kReplacementCharacter));
+
+	const unsigned char *const p(
+		reinterpret_cast<const unsigned char *>(s.data()));
+	const std::size_t n(s.size());
+	std::size_t start(from);
+	Utf8State state(kInitialState);
+	for (std::size_t i = from; i < n; ) {
+		if (state.need == 0)
+			start = i;
+
+		if (Step(state, p[i])) {
+			++i;
+			if (state.need == 0)
+				out.append(s, start, i - start);
+			continue;
+		}
+
+		// The bytes decoded so far are a maximal subpart, or the
+		// lead byte alone is ill-formed. The current byte is decoded
+		// again from the initial state.
+		out.append(kReplacementCharacter);
+		if (state.need == 0)
+			++i;
+		state = kInitialState;
+	}
+	if (state.need != 0)
+		out.append(kReplacementCharacter);
+
+	s.swap(out);
+}
+
+} // namespace rcat
@@ -0,0 +1,23 @@
+#ifndef RCAT_UTF8_H
+#define RCAT_UTF8_H
+
+#include <cstddef>	// size_t
+#include <string>
+
+namespace rcat {
+
+static const std::size_t kValidUtf8(std::string::npos);
+
+// Count "sep" in [s, s + n) and validate it as UTF-8 in the same pass.
+// "invalid" is set to the offset of the first ill-formed sequence, or
+// kValidUtf8 if there is none.
+std::size_t CountAndValidateUtf8(
+	const char *s, std::size_t n, char sep, std::size_t &invalid);
+
+// Replace each maximal ill-formed subsequence of "s" at or after "from"
+// with U+FFFD, as recommended by the Unicode Standard.
+void ReplaceInvalidUtf8(std::string &s, std::size_t from);
+
+} // namespace rcat
+
+#endif // RCAT_UTF8_H
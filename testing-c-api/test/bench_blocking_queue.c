@@ -0,0 +1,428 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np from pthread.h */
+
+/*
+ * Benchmark of blocking queue backends.
+ *
+ * usage: bench_blocking_queue [-b backend] [-p producers] [-c consumers]
+ *        [-q capacity] [-B batch] [-n elements] [-s spins] [-y yields]
+ *        [-N numa-node] [-a cpu,cpu,...]
+ *
+ * Each producer puts "elements" elements, "batch" at a time with
+ * bq_put_many() if it is greater than 1, and consumers take them likewise
+ * until the queue is closed and drained. An element is the time it was put
+ * at, so that a consumer tells how long it took to be handed off.
+ *
+ * "backend" is mutex, mpmc, spsc or all, which runs every backend the
+ * numbers of producers and consumers allow. With "-a", threads are pinned
+ * to the CPUs in turn, producers first. "-N" binds the ring buffers of the
+ * lock-free backends to a NUMA node; the mutex one grows, so it takes none.
+ *
+ * Built as bench_blocking_queue_shared_lines, fields of a queue are packed
+ * instead of put on cache lines of their own, to compare false sharing.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocking_queue.h"
+
+/*
+ * A histogram of latencies in nanoseconds, with 32 buckets for each power
+ * of 2, so that a percentile is at most about 3% off.
+ */
+#define SUB_BITS 5
+#define NR_SUBS (1 << SUB_BITS)
+#define NR_BUCKETS ((64 - SUB_BITS) * NR_SUBS)
+
+struct histogram {
+	uint64_t counts[NR_BUCKETS];
+};
+
+static int bucket_of(uint64_t ns)
+{
+	if (ns < 2 * NR_SUBS)
+		return (int)ns;
+	const int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+	return (shift + 1) * NR_SUBS + (int)((ns >> shift) & (NR_SUBS - 1));
+}
+
+static uint64_t lower_bound_of(int bucket)
+{
+	if (bucket < 2 * NR_SUBS)
+		return (uint64_t)bucket;
+	const int shift = bucket / NR_SUBS - 1;
+	return (uint64_t)(bucket % NR_SUBS + NR_SUBS) << shift;
+}
+
+static uint64_t percentile(const struct histogram *h, uint64_t total,
+	double p)
+{
+	const uint64_t rank = (uint64_t)(total * p);
+	uint64_t sum = 0;
+	for (int i = 0; i < NR_BUCKETS; ++i) {
+		sum += h->counts[i];
+		if (sum > rank)
+			return lower_bound_of(i);
+	}
+	return lower_bound_of(NR_BUCKETS - 1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+struct options {
+	int nr_producers;
+	int nr_consumers;
+	int capacity;
+	int batch;
+	long nr_elements;
+	int nr_spins;
+	int nr_yields;
+	int numa_node;
+	int *cpus;
+	int nr_cpus;
+};
+
+/*
+ * A gate at which threads wait until all of them are ready, and then start
+ * at once; or not at all, if some of them could not be created.
+ */
+struct gate {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int nr_ready;
+	enum { GATE_CLOSED, GATE_OPEN, GATE_ABORTED } state;
+};
+
+/* wait for a gate to open, or return 0 if aborted */
+static _Bool gate_pass(struct gate *gate)
+{
+	pthread_mutex_lock(&gate->mutex);
+	++gate->nr_ready;
+	pthread_cond_broadcast(&gate->cond);
+	while (gate->state == GATE_CLOSED)
+		pthread_cond_wait(&gate->cond, &gate->mutex);
+	const _Bool open = (gate->state == GATE_OPEN);
+	pthread_mutex_unlock(&gate->mutex);
+	return open;
+}
+
+/* open a gate once "nr_threads" are ready at it, or abort it at once */
+static void gate_open(struct gate *gate, int nr_threads, _Bool open)
+{
+	pthread_mutex_lock(&gate->mutex);
+	while (open && gate->nr_ready < nr_threads)
+		pthread_cond_wait(&gate->cond, &gate->mutex);
+	gate->state = open ? GATE_OPEN : GATE_ABORTED;
+	pthread_cond_broadcast(&gate->cond);
+	pthread_mutex_unlock(&gate->mutex);
+}
+
+struct worker {
+	struct bq *queue;
+	const struct options *opts;
+	struct gate *gate;
+	int cpu; /* or -1 not to pin */
+	void **elems; /* "batch" of them to put or take at once */
+	struct histogram *histogram; /* of a consumer */
+	uint64_t nr_taken;
+};
+
+static void pin(int cpu)
+{
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	const int err = pthread_setaffinity_np(pthread_self(),
+		sizeof(set), &set);
+	if (err != 0)
+		fprintf(stderr, "cpu %d: %s\n", cpu, strerror(err));
+}
+
+static void *run_producer(void *arg)
+{
+	struct worker *const w = arg;
+	const int batch = w->opts->batch;
+	void **const elems = w->elems;
+
+	pin(w->cpu);
+	if (!gate_pass(w->gate))
+		return NULL;
+
+	const long nr_elements = w->opts->nr_elements;
+	for (long n = 0; n < nr_elements; ) {
+		const int m = (nr_elements - n < batch) ?
+			(int)(nr_elements - n) : batch;
+		void *const stamp = (void *)(uintptr_t)now_ns();
+		if (m == 1) {
+			bq_put(w->queue, stamp);
+		} else {
+			for (int i = 0; i < m; ++i)
+				elems[i] = stamp;
+			for (int i = 0; i < m; )
+				i += bq_put_many(w->queue,
+					elems + i, m - i);
+		}
+		n += m;
+	}
+	return NULL;
+}
+
+static void *run_consumer(void *arg)
+{
+	struct worker *const w = arg;
+	const int batch = w->opts->batch;
+	void **const elems = w->elems;
+
+	pin(w->cpu);
+	if (!gate_pass(w->gate))
+		return NULL;
+
+	int n = 0;
+	while ((n = bq_take_many(w->queue, elems, batch)) > 0) {
+		const uint64_t now = now_ns();
+		for (int i = 0; i < n; ++i) {
+			const uint64_t put_at = (uintptr_t)elems[i];
+			const uint64_t ns = (now > put_at) ? now - put_at : 0;
+			++w->histogram->counts[bucket_of(ns)];
+		}
+		w->nr_taken += n;
+	}
+	return NULL;
+}
+
+static const char *const backend_names[] = {"mutex", "mpmc", "spsc"};
+
+static int run(enum bq_backend backend, const struct options *opts)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = backend;
+	attr.nr_spins = opts->nr_spins;
+	attr.nr_yields = opts->nr_yields;
+	if (backend != BQ_BACKEND_MUTEX)
+		attr.numa_node = opts->numa_node; /* the mutex one grows */
+	struct bq *const queue = bq_new_attr(opts->capacity, &attr);
+	if (!queue) {
+		perror(backend_names[backend]);
+		return 1;
+	}
+
+	int ret = 1;
+	const int nr_threads = opts->nr_producers + opts->nr_consumers;
+	pthread_t *const threads = calloc(nr_threads, sizeof(pthread_t));
+	struct worker *const workers =
+		calloc(nr_threads, sizeof(struct worker));
+	struct histogram *const histograms =
+		calloc(opts->nr_consumers, sizeof(struct histogram));
+	void **const elems =
+		calloc((size_t)nr_threads * opts->batch, sizeof(void *));
+	if (!threads || !workers || !histograms || !elems) {
+		perror("calloc");
+		goto out;
+	}
+
+	struct gate gate = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.nr_ready = 0,
+		.state = GATE_CLOSED,
+	};
+	int nr_started = 0;
+	for (int i = 0; i < nr_threads; ++i) {
+		struct worker *const w = &workers[i];
+		w->queue = queue;
+		w->opts = opts;
+		w->gate = &gate;
+		w->cpu = (opts->nr_cpus > 0) ?
+			opts->cpus[i % opts->nr_cpus] : -1;
+		w->elems = elems + (size_t)i * opts->batch;
+		if (i >= opts->nr_producers)
+			w->histogram = &histograms[i - opts->nr_producers];
+		const int err = pthread_create(&threads[i], NULL,
+			(i < opts->nr_producers) ? run_producer : run_consumer,
+			w);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			break;
+		}
+		++nr_started;
+	}
+	if (nr_started < nr_threads) {
+		/* those started return without touching the queue */
+		gate_open(&gate, nr_started, 0);
+		for (int i = 0; i < nr_started; ++i)
+			pthread_join(threads[i], NULL);
+		goto out;
+	}
+
+	gate_open(&gate, nr_threads, 1);
+	const uint64_t start = now_ns();
+	for (int i = 0; i < opts->nr_producers; ++i)
+		pthread_join(threads[i], NULL);
+	bq_close(queue);
+	for (int i = opts->nr_producers; i < nr_threads; ++i)
+		pthread_join(threads[i], NULL);
+	const uint64_t elapsed = now_ns() - start;
+
+	/* merge histograms of consumers */
+	uint64_t total = 0;
+	for (int i = opts->nr_producers; i < nr_threads; ++i)
+		total += workers[i].nr_taken;
+	for (int i = 1; i < opts->nr_consumers; ++i) {
+		for (int j = 0; j < NR_BUCKETS; ++j)
+			histograms[0].counts[j] += histograms[i].counts[j];
+	}
+
+	struct bq_stats stats;
+	bq_get_stats(queue, &stats);
+	printf("%-6s %12.0f %10llu %10llu %10llu %10llu %10llu\n",
+		backend_names[backend], total / (elapsed * 1e-9),
+		(unsigned long long)percentile(&histograms[0], total, 0.5),
+		(unsigned long long)percentile(&histograms[0], total, 0.99),
+		(unsigned long long)percentile(&histograms[0], total, 0.999),
+		(unsigned long long)stats.nr_put_blocks,
+		(unsigned long long)stats.nr_take_blocks);
+
+	ret = 0;
+
+out:
+	free(elems);
+	free(histograms);
+	free(workers);
+	free(threads);
+	bq_destroy(queue, NULL);
+	return ret;
+}
+
+static int parse_cpus(char *list, struct options *opts)
+{
+	opts->nr_cpus = 0;
+	for (const char *p = list; *p; ++p)
+		opts->nr_cpus += (*p == ',');
+	++opts->nr_cpus;
+
+	opts->cpus = malloc(sizeof(int) * opts->nr_cpus);
+	if (!opts->cpus)
+		return 0;
+
+	int n = 0;
+	for (char *save = NULL, *tok = strtok_r(list, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		char *end = NULL;
+		const long cpu = strtol(tok, &end, 10);
+		if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE)
+			return 0;
+		opts->cpus[n++] = (int)cpu;
+	}
+	opts->nr_cpus = n;
+	return (n > 0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b mutex|mpmc|spsc|all] [-p producers] "
+		"[-c consumers]\n\t[-q capacity] [-B batch] [-n elements] "
+		"[-s spins] [-y yields]\n\t[-N numa-node] [-a cpu,cpu,...]\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opts = {
+		.nr_producers = 1,
+		.nr_consumers = 1,
+		.capacity = 1024,
+		.batch = 1,
+		.nr_elements = 1000 * 1000,
+		.nr_spins = 0,
+		.nr_yields = 0,
+		.numa_node = -1,
+		.cpus = NULL,
+		.nr_cpus = 0,
+	};
+	const char *backend = "all";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:c:q:B:n:s:y:N:a:")) != -1) {
+		switch (opt) {
+		case 'b': backend = optarg; break;
+		case 'p': opts.nr_producers = atoi(optarg); break;
+		case 'c': opts.nr_consumers = atoi(optarg); break;
+		case 'q': opts.capacity = atoi(optarg); break;
+		case 'B': opts.batch = atoi(optarg); break;
+		case 'n': opts.nr_elements = atol(optarg); break;
+		case 's': opts.nr_spins = atoi(optarg); break;
+		case 'y': opts.nr_yields = atoi(optarg); break;
+		case 'N': opts.numa_node = atoi(optarg); break;
+		case 'a':
+			if (!parse_cpus(optarg, &opts)) {
+				fprintf(stderr, "%s: invalid cpus\n", argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opts.nr_producers <= 0 || opts.nr_consumers <= 0 ||
+			opts.capacity <= 0 || opts.batch <= 0 ||
+			opts.nr_elements <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* backends to run, of which spsc only with one of each */
+	const _Bool all = (strcmp(backend, "all") == 0);
+	const _Bool spsc_ok =
+		(opts.nr_producers == 1 && opts.nr_consumers == 1);
+	_Bool selected[BQ_BACKEND_SPSC + 1] = {0};
+	_Bool found = 0;
+	for (int i = BQ_BACKEND_MUTEX; i <= BQ_BACKEND_SPSC; ++i) {
+		selected[i] = all || strcmp(backend, backend_names[i]) == 0;
+		found |= selected[i];
+	}
+	if (!found) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!spsc_ok && selected[BQ_BACKEND_SPSC]) {
+		if (!all) {
+			fprintf(stderr,
+				"spsc: only 1 producer and 1 consumer\n");
+			return 1;
+		}
+		selected[BQ_BACKEND_SPSC] = 0;
+	}
+	if (opts.numa_node != -1 && !all && selected[BQ_BACKEND_MUTEX]) {
+		fprintf(stderr, "mutex: -N only for mpmc and spsc\n");
+		return 1;
+	}
+
+	printf("%d producers, %d consumers, capacity %d, batch %d, "
+		"%ld elements each\n", opts.nr_producers, opts.nr_consumers,
+		opts.capacity, opts.batch, opts.nr_elements);
+	printf("%-6s %12s %10s %10s %10s %10s %10s\n", "queue", "ops/sec",
+		"p50 ns", "p99 ns", "p99.9 ns", "put parks", "take parks");
+
+	int ret = 0;
+	for (int i = BQ_BACKEND_MUTEX; i <= BQ_BACKEND_SPSC; ++i) {
+		if (selected[i])
+			ret |= run((enum bq_backend)i, &opts);
+	}
+
+	free(opts.cpus);
+	return ret;
+}
@@ -0,0 +1,254 @@
+/*
+ * Benchmark of the work-stealing thread pool against a pool whose workers
+ * all take tasks from a single shared blocking queue.
+ *
+ * usage: bench_thread_pool [-w workers] [-n tasks] [-d depth] [-s spins]
+ *
+ * "flat" submits "tasks" tasks from the main thread, and "fork-join" has
+ * tasks submit two children each down to a depth of "depth". Each task
+ * spins "spins" times, to see how pools do with tasks as small as that.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocking_queue.h"
+#include "thread_pool.h"
+
+/* capacity of the queues of both pools */
+#define POOL_CAPACITY 1024
+
+/*
+ * A plain thread pool on a shared blocking queue, an MPMC one as large as
+ * the injection queue of the work-stealing pool. A worker finding it full
+ * runs a task it submits by itself, so as not to block while all the
+ * others do.
+ */
+struct shared_pool {
+	struct bq *queue_;
+	int nr_workers_;
+	pthread_t *threads_;
+	atomic_long nr_pending_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_done_;
+};
+
+struct shared_task {
+	void (*func_)(void *);
+	void *arg_;
+};
+
+/* the pool of which a calling thread is a worker, if any */
+static __thread struct shared_pool *shared_self_ = NULL;
+
+static void shared_done(struct shared_pool *pool)
+{
+	if (atomic_fetch_sub(&pool->nr_pending_, 1) == 1) {
+		pthread_mutex_lock(&pool->mutex_);
+		pthread_cond_broadcast(&pool->cond_done_);
+		pthread_mutex_unlock(&pool->mutex_);
+	}
+}
+
+static void *shared_run(void *arg)
+{
+	struct shared_pool *const pool = arg;
+	struct shared_task *task = NULL;
+	shared_self_ = pool;
+	while ((task = bq_take(pool->queue_))) {
+		task->func_(task->arg_);
+		free(task);
+		shared_done(pool);
+	}
+	return NULL; /* closed and drained */
+}
+
+static void *shared_new(int nr_workers)
+{
+	struct shared_pool *const pool = malloc(sizeof(struct shared_pool));
+	if (!pool)
+		return NULL;
+	pool->queue_ = bq_new_mpmc(POOL_CAPACITY);
+	pool->nr_workers_ = nr_workers;
+	pool->threads_ = malloc(sizeof(pthread_t) * nr_workers);
+	if (!pool->queue_ || !pool->threads_) {
+		if (pool->queue_)
+			bq_destroy(pool->queue_, NULL);
+		free(pool->threads_);
+		free(pool);
+		return NULL;
+	}
+	atomic_init(&pool->nr_pending_, 0);
+	pthread_mutex_init(&pool->mutex_, NULL);
+	pthread_cond_init(&pool->cond_done_, NULL);
+	for (int i = 0; i < nr_workers; ++i)
+		pthread_create(&pool->threads_[i], NULL, shared_run, pool);
+	return pool;
+}
+
+static _Bool shared_submit(void *raw, void (*func)(void *), void *arg)
+{
+	struct shared_pool *const pool = raw;
+	struct shared_task *const task = malloc(sizeof(struct shared_task));
+	if (!task)
+		return 0;
+	task->func_ = func;
+	task->arg_ = arg;
+	atomic_fetch_add(&pool->nr_pending_, 1);
+	if (shared_self_ == pool ? bq_offer(pool->queue_, task)
+			: bq_put(pool->queue_, task))
+		return 1;
+
+	free(task);
+	shared_done(pool);
+	if (shared_self_ != pool)
+		return 0;
+	func(arg); /* in a worker finding the queue full */
+	return 1;
+}
+
+static void shared_wait(void *raw)
+{
+	struct shared_pool *const pool = raw;
+	pthread_mutex_lock(&pool->mutex_);
+	while (atomic_load(&pool->nr_pending_) > 0)
+		pthread_cond_wait(&pool->cond_done_, &pool->mutex_);
+	pthread_mutex_unlock(&pool->mutex_);
+}
+
+static void shared_destroy(void *raw)
+{
+	struct shared_pool *const pool = raw;
+	shared_wait(pool);
+	bq_close(pool->queue_);
+	for (int i = 0; i < pool->nr_workers_; ++i)
+		pthread_join(pool->threads_[i], NULL);
+	bq_destroy(pool->queue_, NULL);
+	pthread_mutex_destroy(&pool->mutex_);
+	pthread_cond_destroy(&pool->cond_done_);
+	free(pool->threads_);
+	free(pool);
+}
+
+static void *stealing_new(int nr_workers)
+{
+	return tp_new(nr_workers, POOL_CAPACITY);
+}
+
+static _Bool stealing_submit(void *pool, void (*func)(void *), void *arg)
+{
+	return tp_submit(pool, func, arg);
+}
+
+static void stealing_wait(void *pool)
+{
+	tp_wait(pool);
+}
+
+static void stealing_destroy(void *pool)
+{
+	tp_destroy(pool);
+}
+
+struct pool_ops {
+	const char *name;
+	void *(*new)(int nr_workers);
+	_Bool (*submit)(void *pool, void (*func)(void *), void *arg);
+	void (*wait)(void *pool);
+	void (*destroy)(void *pool);
+};
+
+static const struct pool_ops pools[] = {
+	{"shared-bq", shared_new, shared_submit, shared_wait, shared_destroy},
+	{"work-stealing", stealing_new, stealing_submit, stealing_wait,
+		stealing_destroy},
+};
+
+/* the pool being benchmarked, for tasks to submit their children */
+static const struct pool_ops *ops_;
+static void *pool_;
+static int nr_spins_ = 100;
+
+static void spin(void *arg)
+{
+	(void)arg;
+	for (volatile int i = 0; i < nr_spins_; ++i)
+		;
+}
+
+static void fork_join(void *arg)
+{
+	const intptr_t depth = (intptr_t)arg;
+	spin(NULL);
+	if (depth == 0)
+		return;
+	ops_->submit(pool_, fork_join, (void *)(depth - 1));
+	ops_->submit(pool_, fork_join, (void *)(depth - 1));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	long nr_tasks = 1000 * 1000;
+	int depth = 20;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:n:d:s:")) != -1) {
+		switch (opt) {
+		case 'w': nr_workers = atoi(optarg); break;
+		case 'n': nr_tasks = atol(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 's': nr_spins_ = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-w workers] [-n tasks] "
+				"[-d depth] [-s spins]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nr_workers <= 0 || nr_tasks <= 0 || depth < 0 || depth > 30) {
+		fprintf(stderr, "%s: invalid option\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d workers, %d spins per task\n", nr_workers, nr_spins_);
+	printf("%-14s %-10s %10s %14s\n", "pool", "workload", "tasks",
+		"tasks/sec");
+	for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); ++i) {
+		ops_ = &pools[i];
+		pool_ = ops_->new(nr_workers);
+		if (!pool_) {
+			perror(ops_->name);
+			return 1;
+		}
+
+		double start = now();
+		for (long j = 0; j < nr_tasks; ++j)
+			ops_->submit(pool_, spin, NULL);
+		ops_->wait(pool_);
+		double elapsed = now() - start;
+		printf("%-14s %-10s %10ld %14.0f\n", ops_->name, "flat",
+			nr_tasks, nr_tasks / elapsed);
+
+		const long nr_forked = (2L << depth) - 1;
+		start = now();
+		ops_->submit(pool_, fork_join, (void *)(intptr_t)depth);
+		ops_->wait(pool_);
+		elapsed = now() - start;
+		printf("%-14s %-10s %10ld %14.0f\n", ops_->name, "fork-join",
+			nr_forked, nr_forked / elapsed);
+
+		ops_->destroy(pool_);
+	}
+	return 0;
+}
@@ -1,13 +1,26 @@
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/queue.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 
 #include "blocking_queue.h"
 
+#define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-#define pthread_cleanup_push_free(p) \
-	pthread_cleanup_push(free, (p))
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
 
 #define pthread_cleanup_push_mutex_unlock(m) \
 	pthread_cleanup_push((void *)pthread_mutex_unlock, (m))
@@ -19,58 +32,444 @@
 	pthread_cleanup_pop(0)
 
 /* prototype */
-struct bq_elem;
+struct bq_slot;
 static void do_nothing(void *);
+static uint64_t bq_load(atomic_uint_least64_t *);
+static void bq_inc_unsafe(atomic_uint_least64_t *, uint64_t);
+static uint64_t bq_now_ns(void);
+static int bq_size_unsafe(const struct bq *);
+static void bq_add_size_unsafe(struct bq *, int);
+static void bq_set_event(int, _Bool);
+static _Bool bq_closed(const struct bq *);
+static _Bool bq_can_put(const struct bq *);
+static _Bool bq_can_take(const struct bq *);
+static _Bool bq_spin(struct bq *, _Bool (*)(const struct bq *));
+static void bq_count_park(struct bq *, pthread_cond_t *, _Bool *);
+static void bq_cond_wait(struct bq *, pthread_cond_t *, _Bool *);
+static int bq_cond_timedwait(struct bq *, pthread_cond_t *,
+	const struct timespec *, _Bool *);
 static _Bool bq_empty_unsafe(const struct bq *);
 static _Bool bq_full_unsafe(const struct bq *);
-static void bq_insert_unsafe(struct bq *, struct bq_elem *);
-static struct bq_elem *bq_remove_unsafe(struct bq *);
+static _Bool bq_insert_unsafe(struct bq *, void *);
+static void *bq_remove_unsafe(struct bq *);
+static size_t bq_ring_index(const struct bq *, size_t);
+static struct bq_slot *bq_ring_slot(const struct bq *, size_t, size_t *);
+static _Bool bq_spsc_offer(struct bq *, void *);
+static void *bq_spsc_poll(struct bq *);
+static int bq_spsc_offer_many(struct bq *, void *const *, int);
+static int bq_spsc_poll_many(struct bq *, void **, int);
+static _Bool bq_mpmc_offer(struct bq *, void *);
+static int bq_mpmc_offer_many(struct bq *, void *const *, int);
+static _Bool bq_ring_offer(struct bq *, void *);
+static void *bq_ring_poll(struct bq *);
+static _Bool bq_ring_enter_put(struct bq *);
+static void bq_ring_leave_put(struct bq *);
+static void bq_ring_wait_puts(struct bq *);
+static _Bool bq_ring_put(struct bq *, void *);
+static void *bq_ring_take(struct bq *);
+static void bq_ring_unpark_put(void *);
+static void bq_ring_unpark_take(void *);
+static void bq_ring_wait_slot(struct bq_slot *, size_t);
+static int bq_ring_offer_many(struct bq *, void *const *, int);
+static int bq_ring_poll_many(struct bq *, void **, int);
+static int bq_ring_put_many(struct bq *, void *const *, int);
+static _Bool bq_ring_put_timed(struct bq *, void *, const struct timespec *);
+static void *bq_ring_take_timed(struct bq *, const struct timespec *);
+static int bq_ring_take_many(struct bq *, void **, int);
+static void bq_ring_wake(struct bq *, atomic_int *, pthread_cond_t *, int);
+static _Bool bq_valid_elements(void *const *, int);
+static _Bool bq_valid_deadline(const struct timespec *);
+static void bq_wake_unsafe(pthread_cond_t *, int);
+static int bq_insert_many_unsafe(struct bq *, void *const *, int);
+static int bq_remove_many_unsafe(struct bq *, void **, int);
+
+/* elements a queue has room for at first, unless its capacity is less */
+#define BQ_INITIAL_ELEMS 64
+
+/* bytes of a cache line, which threads writing different fields share */
+#define BQ_CACHE_LINE 64
 
-STAILQ_HEAD(bq_head, bq_elem);
+/*
+ * Put a field and those after it on cache lines of their own, unless built
+ * with -DBQ_SHARED_LINES to measure how much false sharing that saves. The
+ * ends of the lock-free rings and the parked counts they read are aligned
+ * with _Alignas() either way, as they always were.
+ */
+#ifdef BQ_SHARED_LINES
+#define BQ_OWN_LINE
+#else
+#define BQ_OWN_LINE _Alignas(BQ_CACHE_LINE)
+#endif
 
-struct bq_elem {
+/* NUMA nodes a ring buffer can be bound to */
+#define BQ_MAX_NUMA_NODES 1024
+
+/* times to spin for a slot reserved by another thread before yielding */
+#define BQ_SLOT_SPINS 64
+
+/*
+ * A slot of a ring buffer. A slot at index "i" is ready to put an element
+ * at position "pos" if its sequence number is "pos", and ready to take it
+ * if "pos + 1". Since slots are zero-filled when mapped, "seq_" holds the
+ * sequence number less "i", so that its initial value is 0.
+ */
+struct bq_slot {
+	atomic_size_t seq_;
 	void *elem_;
-	STAILQ_ENTRY(bq_elem) next_;
 };
 
+/*
+ * Fields are grouped by which threads write them, and each group starts a
+ * cache line, so that a thread writing one group does not invalidate a line
+ * other threads are reading. A queue is allocated aligned to a cache line.
+ */
 struct bq {
-	int size_;
+	/* set up once and read by everyone */
+	enum bq_backend kind_;
 	int capacity_;
-	struct bq_head head_;
-	pthread_mutex_t mutex_;
-	pthread_cond_t cond_can_put_;
-	pthread_cond_t cond_can_take_;
+	struct bq_slot *slots_; /* MPMC; SPSC puts elements into "elems_" */
+	size_t mask_; /* "capacity_ - 1" if a power of 2; 0 otherwise */
+	int nr_spins_; /* how long to spin and yield before parking */
+	int nr_yields_;
+	int take_efd_; /* readable while not empty if BQ_BACKEND_MUTEX */
+	int put_efd_; /* readable while not full if BQ_BACKEND_MUTEX */
+	atomic_bool closed_; /* set under "mutex_" once but read without it */
+
+	/*
+	 * BQ_BACKEND_MUTEX, written by whoever holds "mutex_". Counters are
+	 * only written under it, so that they need no atomic read-modify-write.
+	 * Those of the lock-free backends are "tail_" and "head_pos_".
+	 */
+	BQ_OWN_LINE pthread_mutex_t mutex_;
+	atomic_int size_; /* written under "mutex_" but read without it */
+	int first_; /* index of the head element */
+	void **elems_; /* a ring buffer of "nr_elems_" elements */
+	int nr_elems_;
+	atomic_uint_least64_t nr_puts_;
+	atomic_uint_least64_t nr_takes_;
+
+	/*
+	 * Producers parked while full, and consumers parked while empty,
+	 * written only when one parks. "mutex_" is also to park in the
+	 * lock-free backends, whose puts and takes read "nr_parked_*_" to see
+	 * if they have to wake anyone.
+	 */
+	_Alignas(BQ_CACHE_LINE) pthread_cond_t cond_can_put_;
+	atomic_int nr_parked_put_;
+	atomic_uint_least64_t nr_put_parks_;
+	BQ_OWN_LINE pthread_cond_t cond_can_take_;
+	atomic_int nr_parked_take_;
+	atomic_uint_least64_t nr_take_parks_;
+
+	/*
+	 * BQ_BACKEND_MPMC and BQ_BACKEND_SPSC. Each end has a cache line of
+	 * its own, with what the other end was seen at last if SPSC, so that
+	 * it reads the other's line only when the queue looks full or empty.
+	 */
+	_Alignas(BQ_CACHE_LINE) atomic_size_t tail_; /* position to put at */
+	size_t cached_head_;
+	atomic_int nr_putting_; /* puts which may not have seen "closed_" */
+	_Alignas(BQ_CACHE_LINE) atomic_size_t head_pos_; /* to take at */
+	size_t cached_tail_;
+
+	/* written only by threads about to park */
+	BQ_OWN_LINE atomic_uint_least64_t nr_spun_;
+	atomic_uint_least64_t nr_yielded_;
+	atomic_uint_least64_t wait_ns_;
 };
 
-struct bq *bq_new(int capacity)
+void bq_attr_init(struct bq_attr *attr)
+{
+	attr->backend = BQ_BACKEND_MUTEX;
+	attr->nr_spins = 0;
+	attr->nr_yields = 0;
+	attr->use_eventfd = 0;
+	attr->numa_node = -1;
+}
+
+static struct bq *bq_alloc(int capacity, const struct bq_attr *attr)
 {
-	if (unlikely(capacity <= 0))
+	if (unlikely(capacity <= 0 || attr->nr_spins < 0 ||
+			attr->nr_yields < 0))
 		return NULL;
 
-	struct bq *const queue = malloc(sizeof(struct bq));
-	if (unlikely(!queue))
+	/* only a lock tells exactly when a queue gets empty or full */
+	if (unlikely(attr->use_eventfd && attr->backend != BQ_BACKEND_MUTEX))
+		return NULL;
+
+	/* nor is memory of a growing ring buffer bound to a node */
+	if (unlikely(attr->numa_node < -1 || (attr->numa_node >= 0 &&
+			attr->backend == BQ_BACKEND_MUTEX)))
+		return NULL;
+
+	struct bq *queue = NULL;
+	if (unlikely(posix_memalign((void **)&queue,
+			BQ_CACHE_LINE, sizeof(struct bq)) != 0))
 		return NULL;
 
-	queue->size_ = 0;
+	queue->kind_ = attr->backend;
+	atomic_init(&queue->size_, 0);
 	queue->capacity_ = capacity;
-	STAILQ_INIT(&queue->head_);
+	queue->elems_ = NULL;
+	queue->nr_elems_ = 0;
+	queue->first_ = 0;
 	pthread_mutex_init(&queue->mutex_, NULL);
-	pthread_cond_init(&queue->cond_can_put_, NULL);
-	pthread_cond_init(&queue->cond_can_take_, NULL);
+
+	/* deadlines of timed waits are of CLOCK_MONOTONIC */
+	pthread_condattr_t condattr;
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->cond_can_put_, &condattr);
+	pthread_cond_init(&queue->cond_can_take_, &condattr);
+	pthread_condattr_destroy(&condattr);
+	queue->take_efd_ = -1;
+	queue->put_efd_ = -1;
+	atomic_init(&queue->closed_, 0);
+
+	queue->slots_ = NULL;
+	queue->mask_ = 0;
+	atomic_init(&queue->tail_, 0);
+	atomic_init(&queue->nr_putting_, 0);
+	queue->cached_head_ = 0;
+	atomic_init(&queue->head_pos_, 0);
+	queue->cached_tail_ = 0;
+	atomic_init(&queue->nr_parked_put_, 0);
+	atomic_init(&queue->nr_parked_take_, 0);
+
+	queue->nr_spins_ = attr->nr_spins;
+	queue->nr_yields_ = attr->nr_yields;
+	atomic_init(&queue->nr_spun_, 0);
+	atomic_init(&queue->nr_yielded_, 0);
+	atomic_init(&queue->wait_ns_, 0);
+	atomic_init(&queue->nr_puts_, 0);
+	atomic_init(&queue->nr_takes_, 0);
+	atomic_init(&queue->nr_put_parks_, 0);
+	atomic_init(&queue->nr_take_parks_, 0);
+	return queue;
+}
+
+/*
+ * A queue of a huge capacity cannot allocate all the room at once, so it
+ * starts small and doubles the room as it gets full. Once it has room for
+ * as many elements as it keeps at once, putting and taking them never
+ * allocates memory.
+ */
+static _Bool bq_init_mutex(struct bq *queue, int capacity)
+{
+	const int nr_elems =
+		(capacity < BQ_INITIAL_ELEMS) ? capacity : BQ_INITIAL_ELEMS;
+	queue->elems_ = malloc(sizeof(void *) * nr_elems);
+	if (unlikely(!queue->elems_))
+		return 0;
+
+	queue->nr_elems_ = nr_elems;
+	return 1;
+}
+
+static _Bool bq_init_eventfd(struct bq *queue)
+{
+	queue->take_efd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (unlikely(queue->take_efd_ < 0))
+		return 0;
+
+	queue->put_efd_ = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+	return (queue->put_efd_ >= 0);
+}
+
+/*
+ * Prefer a NUMA node for pages of a ring buffer, which are allocated there
+ * when they are touched at first, or any node if it is full.
+ */
+static _Bool bq_bind_numa_node(void *addr, size_t len, int node)
+{
+	if (node < 0)
+		return 1;
+	if (unlikely(node >= BQ_MAX_NUMA_NODES)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	enum { BITS = 8 * sizeof(unsigned long) };
+	unsigned long nodemask[BQ_MAX_NUMA_NODES / BITS] = {0};
+	nodemask[node / BITS] = 1UL << (node % BITS);
+
+	/*
+	 * The kernel takes one less bit than "maxnode". MPOL_PREFERRED is only
+	 * advisory, so a kernel without NUMA, or a sandbox denying mbind(), is
+	 * taken to bind a ring as well as it can be.
+	 */
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED,
+			nodemask, BQ_MAX_NUMA_NODES + 1, 0) == 0)
+		return 1;
+	return (errno == ENOSYS || errno == EPERM);
+}
+
+static _Bool bq_init_ring(struct bq *queue, int capacity, int node)
+{
+	/*
+	 * Slots are mapped without reserving swap space, so that pages of
+	 * a huge ring are not committed until elements reach them.
+	 */
+	void *const slots = mmap(NULL, sizeof(struct bq_slot) * capacity,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (unlikely(slots == MAP_FAILED))
+		return 0;
+
+	queue->slots_ = slots;
+	if (unlikely(!bq_bind_numa_node(slots,
+			sizeof(struct bq_slot) * capacity, node)))
+		return 0;
+	if ((capacity & (capacity - 1)) == 0)
+		queue->mask_ = capacity - 1;
+	return 1;
+}
+
+static _Bool bq_init_spsc(struct bq *queue, int capacity, int node)
+{
+	void *const elems = mmap(NULL, sizeof(void *) * capacity,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (unlikely(elems == MAP_FAILED))
+		return 0;
+
+	queue->elems_ = elems;
+	queue->nr_elems_ = capacity;
+	if (unlikely(!bq_bind_numa_node(elems, sizeof(void *) * capacity,
+			node)))
+		return 0;
+	if ((capacity & (capacity - 1)) == 0)
+		queue->mask_ = capacity - 1;
+	return 1;
+}
+
+struct bq *bq_new_attr(int capacity, const struct bq_attr *attr)
+{
+	struct bq_attr default_attr;
+	if (!attr) {
+		bq_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+
+	struct bq *const queue = bq_alloc(capacity, attr);
+	if (unlikely(!queue))
+		return NULL;
+
+	_Bool ok = 0;
+	switch (attr->backend) {
+	case BQ_BACKEND_MUTEX:
+		ok = bq_init_mutex(queue, capacity);
+		break;
+	case BQ_BACKEND_MPMC:
+		ok = bq_init_ring(queue, capacity, attr->numa_node);
+		break;
+	case BQ_BACKEND_SPSC:
+		ok = bq_init_spsc(queue, capacity, attr->numa_node);
+		break;
+	}
+	if (ok && attr->use_eventfd)
+		ok = bq_init_eventfd(queue);
+
+	if (unlikely(!ok)) {
+		bq_destroy(queue, NULL);
+		return NULL;
+	}
 	return queue;
 }
 
+struct bq *bq_new(int capacity)
+{
+	return bq_new_attr(capacity, NULL);
+}
+
+struct bq *bq_new_mpmc(int capacity)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND_MPMC;
+	return bq_new_attr(capacity, &attr);
+}
+
+struct bq *bq_new_spsc(int capacity)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND_SPSC;
+	return bq_new_attr(capacity, &attr);
+}
+
 int bq_capacity(const struct bq *queue)
 {
 	return queue->capacity_;
 }
 
+int bq_take_eventfd(const struct bq *queue)
+{
+	return queue->take_efd_;
+}
+
+int bq_put_eventfd(const struct bq *queue)
+{
+	return queue->put_efd_;
+}
+
 int bq_size(struct bq *queue)
+{
+	if (queue->kind_ != BQ_BACKEND_MUTEX) {
+		const size_t head = atomic_load(&queue->head_pos_);
+		const size_t tail = atomic_load(&queue->tail_);
+		if (tail <= head)
+			return 0;
+		return (tail - head < (size_t)queue->capacity_) ?
+			(int)(tail - head) : queue->capacity_;
+	}
+
+	return bq_size_unsafe(queue); /* atomic though written under the lock */
+}
+
+void bq_close(struct bq *queue)
 {
 	pthread_mutex_lock(&queue->mutex_);
-	const int ret = queue->size_; /* TODO lock-free read */
+
+	if (!atomic_exchange(&queue->closed_, 1)) {
+		if (queue->take_efd_ >= 0) {
+			const int size = bq_size_unsafe(queue);
+			if (size == 0)
+				bq_set_event(queue->take_efd_, 1);
+			if (size == queue->capacity_)
+				bq_set_event(queue->put_efd_, 1);
+		}
+		pthread_cond_broadcast(&queue->cond_can_put_);
+		pthread_cond_broadcast(&queue->cond_can_take_);
+	}
+
 	pthread_mutex_unlock(&queue->mutex_);
-	return ret;
+}
+
+void bq_get_wait_stats(struct bq *queue, struct bq_wait_stats *stats)
+{
+	stats->nr_spun = atomic_load_explicit(
+		&queue->nr_spun_, memory_order_relaxed);
+	stats->nr_yielded = atomic_load_explicit(
+		&queue->nr_yielded_, memory_order_relaxed);
+	stats->nr_parked = bq_load(&queue->nr_put_parks_) +
+		bq_load(&queue->nr_take_parks_);
+}
+
+void bq_get_stats(struct bq *queue, struct bq_stats *stats)
+{
+	if (queue->kind_ == BQ_BACKEND_MUTEX) {
+		stats->nr_puts = bq_load(&queue->nr_puts_);
+		stats->nr_takes = bq_load(&queue->nr_takes_);
+	} else {
+		stats->nr_puts = atomic_load_explicit(
+			&queue->tail_, memory_order_relaxed);
+		stats->nr_takes = atomic_load_explicit(
+			&queue->head_pos_, memory_order_relaxed);
+	}
+	stats->nr_put_blocks = bq_load(&queue->nr_put_parks_);
+	stats->nr_take_blocks = bq_load(&queue->nr_take_parks_);
+	stats->wait_ns = bq_load(&queue->wait_ns_);
 }
 
 _Bool bq_put(struct bq *queue, void *raw)
@@ -78,29 +477,42 @@ _Bool bq_put(struct bq *queue, void *raw)
 	if (unlikely(!raw))
 		return 0;
 
-	struct bq_elem *const wrap = malloc(sizeof(struct bq_elem));
-	if (unlikely(!wrap))
+	if (unlikely(bq_closed(queue))) {
+		errno = EPIPE;
 		return 0;
+	}
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_put(queue, raw);
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	_Bool ret = 0; /* assume failure */
 
-	wrap->elem_ = raw;
-	pthread_cleanup_push_free(wrap);
+	if (!bq_can_put(queue))
+		bq_spin(queue, bq_can_put);
 
 	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
 	pthread_mutex_lock(&queue->mutex_);
 	/* critical section >>> */
 
-	while (bq_full_unsafe(queue))
-		pthread_cond_wait(&queue->cond_can_put_, &queue->mutex_);
+	_Bool parked = 0;
+	while (bq_full_unsafe(queue) && !bq_closed(queue))
+		bq_cond_wait(queue, &queue->cond_can_put_, &parked);
 
-	bq_insert_unsafe(queue, wrap);
-	pthread_cond_signal(&queue->cond_can_take_);
+	if (bq_closed(queue)) {
+		errno = EPIPE;
+	} else if (bq_insert_unsafe(queue, raw)) {
+		ret = 1; /* success */
+		pthread_cond_signal(&queue->cond_can_take_);
+	}
 
 	/* <<< critical section */
 	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
 
-	pthread_cleanup_pop_noexec(); /* free */
-
-	return 1;
+	return ret;
 }
 
 _Bool bq_offer(struct bq *queue, void *raw)
@@ -108,11 +520,21 @@ _Bool bq_offer(struct bq *queue, void *raw)
 	if (unlikely(!raw))
 		return 0;
 
-	struct bq_elem *const wrap = malloc(sizeof(struct bq_elem));
-	if (unlikely(!wrap))
+	if (unlikely(bq_closed(queue))) {
+		errno = EPIPE;
 		return 0;
+	}
 
-	wrap->elem_ = raw;
+	if (queue->kind_ != BQ_BACKEND_MUTEX) {
+		if (!bq_ring_offer(queue, raw)) {
+			if (bq_closed(queue))
+				errno = EPIPE;
+			return 0;
+		}
+		bq_ring_wake(queue, &queue->nr_parked_take_,
+			&queue->cond_can_take_, 1);
+		return 1;
+	}
 
 	/*
 	 * "ret" should be defined here because
@@ -124,121 +546,1205 @@ _Bool bq_offer(struct bq *queue, void *raw)
 	pthread_mutex_lock(&queue->mutex_);
 	/* critical section >>> */
 
-	if (!bq_full_unsafe(queue)) {
+	if (bq_closed(queue)) {
+		errno = EPIPE;
+	} else if (!bq_full_unsafe(queue) && bq_insert_unsafe(queue, raw)) {
 		ret = 1; /* success */
-		bq_insert_unsafe(queue, wrap);
 		pthread_cond_signal(&queue->cond_can_take_);
 	}
 
 	/* <<< critical section */
 	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
 
-	if (!ret)
-		free(wrap);
-
 	return ret;
 }
 
 void *bq_take(struct bq *queue)
 {
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_take(queue);
+
 	/*
-	 * "wrap" should be defined here because
+	 * "raw" should be defined here because
 	 * pthread_cleanup_{push,pop} make a code block
 	 */
-	struct bq_elem *wrap = NULL;
+	void *raw = NULL;
+
+	if (!bq_can_take(queue))
+		bq_spin(queue, bq_can_take);
 
 	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
 	pthread_mutex_lock(&queue->mutex_);
 	/* critical section >>> */
 
-	while (bq_empty_unsafe(queue))
-		pthread_cond_wait(&queue->cond_can_take_, &queue->mutex_);
+	_Bool parked = 0;
+	while (bq_empty_unsafe(queue) && !bq_closed(queue))
+		bq_cond_wait(queue, &queue->cond_can_take_, &parked);
 
-	wrap = bq_remove_unsafe(queue);
-	pthread_cond_signal(&queue->cond_can_put_);
+	if (!bq_empty_unsafe(queue)) {
+		raw = bq_remove_unsafe(queue);
+		pthread_cond_signal(&queue->cond_can_put_);
+	} else {
+		errno = EPIPE; /* closed and drained */
+	}
 
 	/* <<< critical section */
 	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
 
-	void *const raw = wrap->elem_;
-	free(wrap);
-
 	return raw;
 }
 
 void *bq_poll(struct bq *queue)
 {
+	if (queue->kind_ != BQ_BACKEND_MUTEX) {
+		void *raw = bq_ring_poll(queue);
+		if (!raw && bq_closed(queue)) {
+			bq_ring_wait_puts(queue);
+			raw = bq_ring_poll(queue);
+			if (!raw) {
+				errno = EPIPE;
+				return NULL;
+			}
+		}
+		if (raw)
+			bq_ring_wake(queue, &queue->nr_parked_put_,
+				&queue->cond_can_put_, 1);
+		return raw;
+	}
+
 	/*
-	 * "wrap" should be defined here because
+	 * "raw" should be defined here because
 	 * pthread_cleanup_{push,pop} make a code block
 	 */
-	struct bq_elem *wrap = NULL; /* assume failure */
+	void *raw = NULL; /* assume failure */
 
 	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
 	pthread_mutex_lock(&queue->mutex_);
 	/* critical section >>> */
 
 	if (!bq_empty_unsafe(queue)) {
-		wrap = bq_remove_unsafe(queue); /* success */
+		raw = bq_remove_unsafe(queue); /* success */
 		pthread_cond_signal(&queue->cond_can_put_);
+	} else if (bq_closed(queue)) {
+		errno = EPIPE;
 	}
 
 	/* <<< critical section */
 	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
 
-	if (!wrap)
-		return NULL;
-
-	void *const raw = wrap->elem_;
-	free(wrap);
-
 	return raw;
 }
 
-void bq_destroy(struct bq *queue, void (*dtor)(void *))
+_Bool bq_put_timed(struct bq *queue, void *raw,
+	const struct timespec *deadline)
 {
-	if (!dtor)
-		dtor = do_nothing;
+	if (unlikely(!raw))
+		return 0;
 
-	struct bq_elem *i = STAILQ_FIRST(&queue->head_);
-	while (i) {
-		struct bq_elem *n = STAILQ_NEXT(i, next_);
-		dtor(i->elem_);
-		free(i);
-		i = n;
+	if (unlikely(!bq_valid_deadline(deadline))) {
+		errno = EINVAL;
+		return 0;
 	}
 
-	pthread_mutex_destroy(&queue->mutex_);
-	pthread_cond_destroy(&queue->cond_can_put_);
-	pthread_cond_destroy(&queue->cond_can_take_);
-	free(queue);
-}
+	if (unlikely(bq_closed(queue))) {
+		errno = EPIPE;
+		return 0;
+	}
 
-static void do_nothing(void *dummy)
-{
-	(void)dummy;
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_put_timed(queue, raw, deadline);
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	_Bool ret = 0; /* assume failure */
+	int err = 0;
+
+	if (!bq_can_put(queue))
+		bq_spin(queue, bq_can_put);
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	_Bool parked = 0;
+	while (bq_full_unsafe(queue) && !bq_closed(queue) &&
+			err != ETIMEDOUT)
+		err = bq_cond_timedwait(queue, &queue->cond_can_put_,
+			deadline, &parked);
+
+	if (bq_closed(queue)) {
+		err = EPIPE;
+	} else if (!bq_full_unsafe(queue) && bq_insert_unsafe(queue, raw)) {
+		ret = 1; /* success */
+		pthread_cond_signal(&queue->cond_can_take_);
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	if (!ret && (err == ETIMEDOUT || err == EPIPE))
+		errno = err;
+	return ret;
 }
 
-static inline _Bool bq_empty_unsafe(const struct bq *queue)
+void *bq_take_timed(struct bq *queue, const struct timespec *deadline)
 {
-	return (queue->size_ <= 0);
+	if (unlikely(!bq_valid_deadline(deadline))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_take_timed(queue, deadline);
+
+	/*
+	 * "raw" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	void *raw = NULL; /* assume failure */
+	int err = 0;
+
+	if (!bq_can_take(queue))
+		bq_spin(queue, bq_can_take);
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	_Bool parked = 0;
+	while (bq_empty_unsafe(queue) && !bq_closed(queue) &&
+			err != ETIMEDOUT)
+		err = bq_cond_timedwait(queue, &queue->cond_can_take_,
+			deadline, &parked);
+
+	if (!bq_empty_unsafe(queue)) {
+		raw = bq_remove_unsafe(queue); /* success */
+		pthread_cond_signal(&queue->cond_can_put_);
+	} else if (bq_closed(queue)) {
+		err = EPIPE;
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	if (!raw)
+		errno = (err == EPIPE) ? EPIPE : ETIMEDOUT;
+	return raw;
 }
 
-static inline _Bool bq_full_unsafe(const struct bq *queue)
+int bq_put_many(struct bq *queue, void *const *elems, int nr_elems)
 {
-	return (queue->size_ >= queue->capacity_);
+	if (unlikely(!bq_valid_elements(elems, nr_elems)))
+		return 0;
+
+	if (unlikely(bq_closed(queue))) {
+		errno = EPIPE;
+		return 0;
+	}
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_put_many(queue, elems, nr_elems);
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	int ret = 0;
+
+	if (!bq_can_put(queue))
+		bq_spin(queue, bq_can_put);
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	_Bool parked = 0;
+	while (bq_full_unsafe(queue) && !bq_closed(queue))
+		bq_cond_wait(queue, &queue->cond_can_put_, &parked);
+
+	if (bq_closed(queue)) {
+		errno = EPIPE;
+	} else {
+		ret = bq_insert_many_unsafe(queue, elems, nr_elems);
+		bq_wake_unsafe(&queue->cond_can_take_, ret);
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
 }
 
-static inline void bq_insert_unsafe(struct bq *queue, struct bq_elem *wrap)
+int bq_offer_many(struct bq *queue, void *const *elems, int nr_elems)
 {
-	STAILQ_INSERT_TAIL(&queue->head_, wrap, next_);
-	++queue->size_;
+	if (unlikely(!bq_valid_elements(elems, nr_elems)))
+		return 0;
+
+	if (unlikely(bq_closed(queue))) {
+		errno = EPIPE;
+		return 0;
+	}
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX) {
+		const int ret = bq_ring_offer_many(queue, elems, nr_elems);
+		if (!ret && bq_closed(queue))
+			errno = EPIPE;
+		bq_ring_wake(queue, &queue->nr_parked_take_,
+			&queue->cond_can_take_, ret);
+		return ret;
+	}
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	int ret = 0;
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	if (bq_closed(queue)) {
+		errno = EPIPE;
+	} else {
+		ret = bq_insert_many_unsafe(queue, elems, nr_elems);
+		bq_wake_unsafe(&queue->cond_can_take_, ret);
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
 }
 
-static inline struct bq_elem *bq_remove_unsafe(struct bq *queue)
+int bq_take_many(struct bq *queue, void **elems, int nr_elems)
 {
-	struct bq_elem *const wrap = STAILQ_FIRST(&queue->head_);
-	STAILQ_REMOVE_HEAD(&queue->head_, next_);
-	--queue->size_;
-	return wrap;
+	if (unlikely(nr_elems <= 0))
+		return 0;
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX)
+		return bq_ring_take_many(queue, elems, nr_elems);
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	int ret = 0;
+
+	if (!bq_can_take(queue))
+		bq_spin(queue, bq_can_take);
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	_Bool parked = 0;
+	while (bq_empty_unsafe(queue) && !bq_closed(queue))
+		bq_cond_wait(queue, &queue->cond_can_take_, &parked);
+
+	ret = bq_remove_many_unsafe(queue, elems, nr_elems);
+	bq_wake_unsafe(&queue->cond_can_put_, ret);
+	if (ret == 0)
+		errno = EPIPE; /* closed and drained */
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
+}
+
+int bq_poll_many(struct bq *queue, void **elems, int nr_elems)
+{
+	if (unlikely(nr_elems <= 0))
+		return 0;
+
+	if (queue->kind_ != BQ_BACKEND_MUTEX) {
+		int ret = bq_ring_poll_many(queue, elems, nr_elems);
+		if (!ret && bq_closed(queue)) {
+			bq_ring_wait_puts(queue);
+			ret = bq_ring_poll_many(queue, elems, nr_elems);
+			if (!ret) {
+				errno = EPIPE;
+				return 0;
+			}
+		}
+		bq_ring_wake(queue, &queue->nr_parked_put_,
+			&queue->cond_can_put_, ret);
+		return ret;
+	}
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	int ret = 0;
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	ret = bq_remove_many_unsafe(queue, elems, nr_elems);
+	bq_wake_unsafe(&queue->cond_can_put_, ret);
+	if (ret == 0 && bq_closed(queue))
+		errno = EPIPE;
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
+}
+
+void bq_destroy(struct bq *queue, void (*dtor)(void *))
+{
+	if (!dtor)
+		dtor = do_nothing;
+
+	if (queue->kind_ == BQ_BACKEND_MUTEX) {
+		while (!bq_empty_unsafe(queue))
+			dtor(bq_remove_unsafe(queue));
+		free(queue->elems_);
+	} else {
+		/* nothing to drain if bq_new_attr() failed to map the ring */
+		void *raw = NULL;
+		while ((queue->slots_ || queue->elems_) &&
+				(raw = bq_ring_poll(queue)))
+			dtor(raw);
+		if (queue->slots_)
+			munmap(queue->slots_,
+				sizeof(struct bq_slot) * queue->capacity_);
+		if (queue->elems_)
+			munmap(queue->elems_,
+				sizeof(void *) * queue->capacity_);
+	}
+
+	if (queue->take_efd_ >= 0)
+		close(queue->take_efd_);
+	if (queue->put_efd_ >= 0)
+		close(queue->put_efd_);
+
+	pthread_mutex_destroy(&queue->mutex_);
+	pthread_cond_destroy(&queue->cond_can_put_);
+	pthread_cond_destroy(&queue->cond_can_take_);
+	free(queue);
+}
+
+static void do_nothing(void *dummy)
+{
+	(void)dummy;
+}
+
+static _Bool bq_valid_elements(void *const *elems, int nr_elems)
+{
+	if (nr_elems <= 0)
+		return 0;
+
+	for (int i = 0; i < nr_elems; ++i) {
+		if (!elems[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * pthread_cond_timedwait() fails with EINVAL at once on a deadline out
+ * of range, which timed loops would retry forever.
+ */
+static _Bool bq_valid_deadline(const struct timespec *deadline)
+{
+	return deadline &&
+		deadline->tv_nsec >= 0 && deadline->tv_nsec < 1000000000L;
+}
+
+/*
+ * Wake a waiting thread for an element or a room, or all of them for
+ * more, with a single call.
+ */
+static inline void bq_wake_unsafe(pthread_cond_t *cond, int nr_elems)
+{
+	if (nr_elems == 1)
+		pthread_cond_signal(cond);
+	else if (nr_elems > 1)
+		pthread_cond_broadcast(cond);
+}
+
+static inline uint64_t bq_load(atomic_uint_least64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* add to a counter only one thread writes at a time */
+static inline void bq_inc_unsafe(atomic_uint_least64_t *counter, uint64_t n)
+{
+	atomic_store_explicit(counter, bq_load(counter) + n,
+		memory_order_relaxed);
+}
+
+static uint64_t bq_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline int bq_size_unsafe(const struct bq *queue)
+{
+	return atomic_load_explicit(&queue->size_, memory_order_relaxed);
+}
+
+/*
+ * An eventfd is readable while its counter is not 0, which is either 0 or
+ * 1 here. Setting or clearing it never fails since it is done only when
+ * the counter is the other.
+ */
+static void bq_set_event(int efd, _Bool set)
+{
+	uint64_t count = 1;
+	const ssize_t ret = set ?
+		write(efd, &count, sizeof(count)) :
+		read(efd, &count, sizeof(count));
+	(void)ret;
+}
+
+static inline void bq_add_size_unsafe(struct bq *queue, int n)
+{
+	const int old_size = bq_size_unsafe(queue);
+	const int new_size = old_size + n;
+	atomic_store_explicit(&queue->size_, new_size, memory_order_relaxed);
+	if (n > 0)
+		bq_inc_unsafe(&queue->nr_puts_, n);
+	else
+		bq_inc_unsafe(&queue->nr_takes_, -n);
+
+	if (likely(queue->take_efd_ < 0) || bq_closed(queue))
+		return; /* eventfds of a closed queue stay readable */
+	if ((old_size == 0) != (new_size == 0))
+		bq_set_event(queue->take_efd_, new_size != 0);
+	if ((old_size == queue->capacity_) != (new_size == queue->capacity_))
+		bq_set_event(queue->put_efd_, new_size != queue->capacity_);
+}
+
+static inline _Bool bq_closed(const struct bq *queue)
+{
+	return atomic_load_explicit(&queue->closed_, memory_order_acquire);
+}
+
+/* whether a blocked thread can go on, peeked at without the lock */
+
+static _Bool bq_can_put(const struct bq *queue)
+{
+	if (bq_closed(queue))
+		return 1; /* to fail */
+	if (queue->kind_ == BQ_BACKEND_MUTEX)
+		return bq_size_unsafe(queue) < queue->capacity_;
+
+	const size_t head = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(
+		&queue->tail_, memory_order_relaxed);
+	return tail < head + (size_t)queue->capacity_;
+}
+
+static _Bool bq_can_take(const struct bq *queue)
+{
+	if (bq_closed(queue))
+		return 1; /* to drain or find the end */
+	if (queue->kind_ == BQ_BACKEND_MUTEX)
+		return bq_size_unsafe(queue) > 0;
+
+	const size_t head = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(
+		&queue->tail_, memory_order_relaxed);
+	return head < tail;
+}
+
+/*
+ * Before parking, spin with a pause and then yield the CPU as many times
+ * as a policy tells, until "ready" holds. Return whether it does.
+ */
+static _Bool bq_spin(struct bq *queue, _Bool (*ready)(const struct bq *))
+{
+	if (queue->nr_spins_ == 0 && queue->nr_yields_ == 0)
+		return 0;
+
+	const uint64_t since = bq_now_ns();
+	atomic_uint_least64_t *counter = NULL;
+
+	for (int i = 0; !counter && i < queue->nr_spins_; ++i) {
+		if (ready(queue))
+			counter = &queue->nr_spun_;
+		else
+			cpu_relax();
+	}
+
+	for (int i = 0; !counter && i < queue->nr_yields_; ++i) {
+		if (ready(queue)) {
+			counter = &queue->nr_yielded_;
+		} else {
+			pthread_testcancel();
+			sched_yield();
+		}
+	}
+
+	if (counter)
+		atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&queue->wait_ns_, bq_now_ns() - since,
+		memory_order_relaxed);
+	return (counter != NULL);
+}
+
+/*
+ * park a calling thread, holding "mutex_", and count it unless "parked",
+ * so that a call waking up and parking again is counted once
+ */
+
+static inline void bq_count_park(struct bq *queue, pthread_cond_t *cond,
+	_Bool *parked)
+{
+	if (*parked)
+		return;
+	*parked = 1;
+	bq_inc_unsafe((cond == &queue->cond_can_put_) ?
+		&queue->nr_put_parks_ : &queue->nr_take_parks_, 1);
+}
+
+static inline void bq_cond_wait(struct bq *queue, pthread_cond_t *cond,
+	_Bool *parked)
+{
+	bq_count_park(queue, cond, parked);
+	const uint64_t since = bq_now_ns();
+	pthread_cond_wait(cond, &queue->mutex_);
+	atomic_fetch_add_explicit(&queue->wait_ns_, bq_now_ns() - since,
+		memory_order_relaxed);
+}
+
+static inline int bq_cond_timedwait(struct bq *queue, pthread_cond_t *cond,
+	const struct timespec *deadline, _Bool *parked)
+{
+	bq_count_park(queue, cond, parked);
+	const uint64_t since = bq_now_ns();
+	const int ret = pthread_cond_timedwait(cond, &queue->mutex_, deadline);
+	atomic_fetch_add_explicit(&queue->wait_ns_, bq_now_ns() - since,
+		memory_order_relaxed);
+	return ret;
+}
+
+static inline _Bool bq_empty_unsafe(const struct bq *queue)
+{
+	return (bq_size_unsafe(queue) <= 0);
+}
+
+static inline _Bool bq_full_unsafe(const struct bq *queue)
+{
+	return (bq_size_unsafe(queue) >= queue->capacity_);
+}
+
+/*
+ * Double the room of a queue, up to its capacity, unwrapping the ring.
+ */
+static _Bool bq_grow_unsafe(struct bq *queue)
+{
+	const int nr_elems = (queue->nr_elems_ <= queue->capacity_ / 2) ?
+		queue->nr_elems_ * 2 : queue->capacity_;
+	void **const elems = malloc(sizeof(void *) * nr_elems);
+	if (unlikely(!elems))
+		return 0;
+
+	const int size = bq_size_unsafe(queue);
+	for (int i = 0; i < size; ++i)
+		elems[i] = queue->elems_[
+			((size_t)queue->first_ + i) % queue->nr_elems_];
+
+	free(queue->elems_);
+	queue->elems_ = elems;
+	queue->nr_elems_ = nr_elems;
+	queue->first_ = 0;
+	return 1;
+}
+
+static inline _Bool bq_insert_unsafe(struct bq *queue, void *raw)
+{
+	const int size = bq_size_unsafe(queue);
+	if (unlikely(size >= queue->nr_elems_) && !bq_grow_unsafe(queue))
+		return 0;
+
+	size_t last = (size_t)queue->first_ + size;
+	if (last >= (size_t)queue->nr_elems_)
+		last -= queue->nr_elems_;
+	queue->elems_[last] = raw;
+	bq_add_size_unsafe(queue, 1);
+	return 1;
+}
+
+static inline void *bq_remove_unsafe(struct bq *queue)
+{
+	void *const raw = queue->elems_[queue->first_];
+	if (++queue->first_ >= queue->nr_elems_)
+		queue->first_ = 0;
+	bq_add_size_unsafe(queue, -1);
+	return raw;
+}
+
+static inline size_t bq_ring_index(const struct bq *queue, size_t pos)
+{
+	return queue->mask_ ?
+		(pos & queue->mask_) : (pos % (size_t)queue->capacity_);
+}
+
+static inline struct bq_slot *bq_ring_slot(
+	const struct bq *queue, size_t pos, size_t *index)
+{
+	*index = bq_ring_index(queue, pos);
+	return &queue->slots_[*index];
+}
+
+/*
+ * With a single producer and a single consumer, each end owns its
+ * position, so putting and taking are wait-free. An end looks at the
+ * other's position only if what it saw last tells the ring is full or
+ * empty.
+ */
+
+static _Bool bq_spsc_offer(struct bq *queue, void *raw)
+{
+	const size_t pos = atomic_load_explicit(
+		&queue->tail_, memory_order_relaxed);
+	if (pos - queue->cached_head_ >= (size_t)queue->capacity_) {
+		queue->cached_head_ = atomic_load_explicit(
+			&queue->head_pos_, memory_order_acquire);
+		if (pos - queue->cached_head_ >= (size_t)queue->capacity_)
+			return 0; /* full */
+	}
+
+	queue->elems_[bq_ring_index(queue, pos)] = raw;
+	atomic_store_explicit(&queue->tail_, pos + 1, memory_order_release);
+	return 1;
+}
+
+static void *bq_spsc_poll(struct bq *queue)
+{
+	const size_t pos = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	if (pos == queue->cached_tail_) {
+		queue->cached_tail_ = atomic_load_explicit(
+			&queue->tail_, memory_order_acquire);
+		if (pos == queue->cached_tail_)
+			return NULL; /* empty */
+	}
+
+	void *const raw = queue->elems_[bq_ring_index(queue, pos)];
+	atomic_store_explicit(&queue->head_pos_, pos + 1,
+		memory_order_release);
+	return raw;
+}
+
+static int bq_spsc_offer_many(
+	struct bq *queue, void *const *elems, int nr_elems)
+{
+	const size_t pos = atomic_load_explicit(
+		&queue->tail_, memory_order_relaxed);
+	size_t room = (size_t)queue->capacity_ - (pos - queue->cached_head_);
+	if (room < (size_t)nr_elems) {
+		queue->cached_head_ = atomic_load_explicit(
+			&queue->head_pos_, memory_order_acquire);
+		room = (size_t)queue->capacity_ - (pos - queue->cached_head_);
+	}
+
+	const size_t n = (room < (size_t)nr_elems) ? room : (size_t)nr_elems;
+	for (size_t i = 0; i < n; ++i)
+		queue->elems_[bq_ring_index(queue, pos + i)] = elems[i];
+	atomic_store_explicit(&queue->tail_, pos + n, memory_order_release);
+	return (int)n;
+}
+
+static int bq_spsc_poll_many(struct bq *queue, void **elems, int nr_elems)
+{
+	const size_t pos = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	size_t avail = queue->cached_tail_ - pos;
+	if (avail < (size_t)nr_elems) {
+		queue->cached_tail_ = atomic_load_explicit(
+			&queue->tail_, memory_order_acquire);
+		avail = queue->cached_tail_ - pos;
+	}
+
+	const size_t n = (avail < (size_t)nr_elems) ? avail : (size_t)nr_elems;
+	for (size_t i = 0; i < n; ++i)
+		elems[i] = queue->elems_[bq_ring_index(queue, pos + i)];
+	atomic_store_explicit(&queue->head_pos_, pos + n,
+		memory_order_release);
+	return (int)n;
+}
+
+static _Bool bq_mpmc_offer(struct bq *queue, void *raw)
+{
+	size_t pos = atomic_load_explicit(&queue->tail_, memory_order_relaxed);
+	struct bq_slot *slot = NULL;
+	size_t index = 0;
+
+	for (;;) {
+		slot = bq_ring_slot(queue, pos, &index);
+		const size_t seq = index + atomic_load_explicit(
+			&slot->seq_, memory_order_acquire);
+		const intptr_t diff = (intptr_t)(seq - pos);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->tail_, &pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return 0; /* full */
+		} else {
+			pos = atomic_load_explicit(
+				&queue->tail_, memory_order_relaxed);
+		}
+	}
+
+	slot->elem_ = raw;
+	atomic_store_explicit(&slot->seq_, pos + 1 - index,
+		memory_order_release);
+	return 1;
+}
+
+/*
+ * A put counts itself in "nr_putting_" while it checks whether a queue is
+ * closed and offers an element, and a consumer which finds a closed queue
+ * empty waits for such puts before it drains the queue the last time.
+ * Either a put sees "closed_" set, or the consumer sees the put counted,
+ * since both are sequentially consistent, so that no element put
+ * successfully is left behind once consumers have got EPIPE.
+ */
+static inline _Bool bq_ring_enter_put(struct bq *queue)
+{
+	atomic_fetch_add(&queue->nr_putting_, 1);
+	if (atomic_load(&queue->closed_)) {
+		bq_ring_leave_put(queue);
+		return 0;
+	}
+	return 1;
+}
+
+static inline void bq_ring_leave_put(struct bq *queue)
+{
+	atomic_fetch_sub_explicit(&queue->nr_putting_, 1,
+		memory_order_release);
+}
+
+static void bq_ring_wait_puts(struct bq *queue)
+{
+	int nr_spins = 0;
+	while (atomic_load(&queue->nr_putting_) > 0) {
+		if (nr_spins < BQ_SLOT_SPINS) {
+			cpu_relax();
+			++nr_spins;
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+/* Return 0 if full, or closed with no element put. */
+static _Bool bq_ring_offer(struct bq *queue, void *raw)
+{
+	if (!bq_ring_enter_put(queue))
+		return 0;
+
+	const _Bool ret = (queue->kind_ == BQ_BACKEND_SPSC) ?
+		bq_spsc_offer(queue, raw) : bq_mpmc_offer(queue, raw);
+	bq_ring_leave_put(queue);
+	return ret;
+}
+
+static int bq_ring_offer_many(
+	struct bq *queue, void *const *elems, int nr_elems)
+{
+	if (!bq_ring_enter_put(queue))
+		return 0;
+
+	const int ret = (queue->kind_ == BQ_BACKEND_SPSC) ?
+		bq_spsc_offer_many(queue, elems, nr_elems) :
+		bq_mpmc_offer_many(queue, elems, nr_elems);
+	bq_ring_leave_put(queue);
+	return ret;
+}
+
+static void *bq_ring_poll(struct bq *queue)
+{
+	if (queue->kind_ == BQ_BACKEND_SPSC)
+		return bq_spsc_poll(queue);
+
+	size_t pos = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	struct bq_slot *slot = NULL;
+	size_t index = 0;
+
+	for (;;) {
+		slot = bq_ring_slot(queue, pos, &index);
+		const size_t seq = index + atomic_load_explicit(
+			&slot->seq_, memory_order_acquire);
+		const intptr_t diff = (intptr_t)(seq - (pos + 1));
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->head_pos_, &pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return NULL; /* empty */
+		} else {
+			pos = atomic_load_explicit(
+				&queue->head_pos_, memory_order_relaxed);
+		}
+	}
+
+	void *const raw = slot->elem_;
+	atomic_store_explicit(&slot->seq_,
+		pos + (size_t)queue->capacity_ - index, memory_order_release);
+	return raw;
+}
+
+static int bq_insert_many_unsafe(
+	struct bq *queue, void *const *elems, int nr_elems)
+{
+	const int room = queue->capacity_ - bq_size_unsafe(queue);
+	const int n = (nr_elems < room) ? nr_elems : room;
+
+	int i = 0;
+	while (i < n && bq_insert_unsafe(queue, elems[i]))
+		++i;
+	return i;
+}
+
+static int bq_remove_many_unsafe(
+	struct bq *queue, void **elems, int nr_elems)
+{
+	const int size = bq_size_unsafe(queue);
+	const int n = (nr_elems < size) ? nr_elems : size;
+	for (int i = 0; i < n; ++i)
+		elems[i] = bq_remove_unsafe(queue);
+	return n;
+}
+
+/*
+ * Wait for another thread to be done with a slot it has reserved. It may
+ * have been preempted, so yield the CPU to it unless it is done soon.
+ */
+static void bq_ring_wait_slot(struct bq_slot *slot, size_t seq)
+{
+	int nr_spins = 0;
+	while (atomic_load_explicit(&slot->seq_, memory_order_acquire) != seq) {
+		if (nr_spins < BQ_SLOT_SPINS) {
+			cpu_relax();
+			++nr_spins;
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+/*
+ * Reserve up to "nr_elems" positions to put at with a single CAS. Each
+ * slot of them is free once a consumer which has reserved its previous
+ * round finishes taking from it, which may not have yet.
+ */
+static int bq_mpmc_offer_many(
+	struct bq *queue, void *const *elems, int nr_elems)
+{
+	size_t pos = atomic_load_explicit(&queue->tail_, memory_order_relaxed);
+	size_t n = 0;
+
+	do {
+		const size_t head = atomic_load_explicit(
+			&queue->head_pos_, memory_order_acquire);
+		const size_t used = (pos > head) ? pos - head : 0;
+		if (used >= (size_t)queue->capacity_)
+			return 0; /* full */
+
+		n = (size_t)queue->capacity_ - used;
+		if (n > (size_t)nr_elems)
+			n = nr_elems;
+	} while (!atomic_compare_exchange_weak_explicit(&queue->tail_,
+			&pos, pos + n,
+			memory_order_relaxed, memory_order_relaxed));
+
+	for (size_t i = 0; i < n; ++i) {
+		size_t index = 0;
+		struct bq_slot *const slot =
+			bq_ring_slot(queue, pos + i, &index);
+		bq_ring_wait_slot(slot, pos + i - index);
+
+		slot->elem_ = elems[i];
+		atomic_store_explicit(&slot->seq_, pos + i + 1 - index,
+			memory_order_release);
+	}
+	return (int)n;
+}
+
+/*
+ * Reserve up to "nr_elems" positions to take at with a single CAS, just
+ * as bq_mpmc_offer_many() does.
+ */
+static int bq_ring_poll_many(struct bq *queue, void **elems, int nr_elems)
+{
+	if (queue->kind_ == BQ_BACKEND_SPSC)
+		return bq_spsc_poll_many(queue, elems, nr_elems);
+
+	size_t pos = atomic_load_explicit(
+		&queue->head_pos_, memory_order_relaxed);
+	size_t n = 0;
+
+	do {
+		const size_t tail = atomic_load_explicit(
+			&queue->tail_, memory_order_acquire);
+		if (tail <= pos)
+			return 0; /* empty */
+
+		n = tail - pos;
+		if (n > (size_t)nr_elems)
+			n = nr_elems;
+	} while (!atomic_compare_exchange_weak_explicit(&queue->head_pos_,
+			&pos, pos + n,
+			memory_order_relaxed, memory_order_relaxed));
+
+	for (size_t i = 0; i < n; ++i) {
+		size_t index = 0;
+		struct bq_slot *const slot =
+			bq_ring_slot(queue, pos + i, &index);
+		bq_ring_wait_slot(slot, pos + i + 1 - index);
+
+		elems[i] = slot->elem_;
+		atomic_store_explicit(&slot->seq_,
+			pos + i + (size_t)queue->capacity_ - index,
+			memory_order_release);
+	}
+	return (int)n;
+}
+
+/*
+ * A thread parks itself by counting itself in "nr_parked" and retrying
+ * under "mutex_", while the other side wakes it only if it sees a count.
+ * Either the retry sees an element or a slot, or the other side sees
+ * the count, since both are separated by a full fence.
+ */
+static void bq_ring_wake(struct bq *queue, atomic_int *nr_parked,
+	pthread_cond_t *cond, int nr_elems)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(nr_parked, memory_order_relaxed) <= 0)
+		return;
+
+	pthread_mutex_lock(&queue->mutex_);
+	bq_wake_unsafe(cond, nr_elems);
+	pthread_mutex_unlock(&queue->mutex_);
+}
+
+static void bq_ring_unpark_put(void *arg)
+{
+	struct bq *const queue = arg;
+	atomic_fetch_sub(&queue->nr_parked_put_, 1);
+	pthread_mutex_unlock(&queue->mutex_);
+}
+
+static void bq_ring_unpark_take(void *arg)
+{
+	struct bq *const queue = arg;
+	atomic_fetch_sub(&queue->nr_parked_take_, 1);
+	pthread_mutex_unlock(&queue->mutex_);
+}
+
+static _Bool bq_ring_put(struct bq *queue, void *raw)
+{
+	_Bool ret = bq_ring_offer(queue, raw);
+	if (!ret && bq_spin(queue, bq_can_put))
+		ret = bq_ring_offer(queue, raw);
+	if (!ret) {
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_put, queue);
+		atomic_fetch_add(&queue->nr_parked_put_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(ret = bq_ring_offer(queue, raw)) && !bq_closed(queue))
+			bq_cond_wait(queue, &queue->cond_can_put_, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_put */
+
+		if (!ret) {
+			errno = EPIPE;
+			return 0;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_take_, &queue->cond_can_take_, 1);
+	return 1;
+}
+
+static void *bq_ring_take(struct bq *queue)
+{
+	void *raw = bq_ring_poll(queue);
+	if (!raw && bq_spin(queue, bq_can_take))
+		raw = bq_ring_poll(queue);
+	if (!raw) {
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_take, queue);
+		atomic_fetch_add(&queue->nr_parked_take_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(raw = bq_ring_poll(queue)) && !bq_closed(queue))
+			bq_cond_wait(queue, &queue->cond_can_take_, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_take */
+
+		/* an element may have been put just before closed */
+		if (!raw) {
+			bq_ring_wait_puts(queue);
+			raw = bq_ring_poll(queue);
+		}
+		if (!raw) {
+			errno = EPIPE;
+			return NULL;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_put_, &queue->cond_can_put_, 1);
+	return raw;
+}
+
+static int bq_ring_put_many(struct bq *queue, void *const *elems, int nr_elems)
+{
+	int ret = bq_ring_offer_many(queue, elems, nr_elems);
+	if (!ret && bq_spin(queue, bq_can_put))
+		ret = bq_ring_offer_many(queue, elems, nr_elems);
+	if (!ret) {
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_put, queue);
+		atomic_fetch_add(&queue->nr_parked_put_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(ret = bq_ring_offer_many(queue, elems, nr_elems)) &&
+				!bq_closed(queue))
+			bq_cond_wait(queue, &queue->cond_can_put_, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_put */
+
+		if (!ret) {
+			errno = EPIPE;
+			return 0;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_take_,
+		&queue->cond_can_take_, ret);
+	return ret;
+}
+
+static int bq_ring_take_many(struct bq *queue, void **elems, int nr_elems)
+{
+	int ret = bq_ring_poll_many(queue, elems, nr_elems);
+	if (!ret && bq_spin(queue, bq_can_take))
+		ret = bq_ring_poll_many(queue, elems, nr_elems);
+	if (!ret) {
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_take, queue);
+		atomic_fetch_add(&queue->nr_parked_take_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(ret = bq_ring_poll_many(queue, elems, nr_elems)) &&
+				!bq_closed(queue))
+			bq_cond_wait(queue, &queue->cond_can_take_, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_take */
+
+		/* elements may have been put just before closed */
+		if (!ret) {
+			bq_ring_wait_puts(queue);
+			ret = bq_ring_poll_many(queue, elems, nr_elems);
+		}
+		if (!ret) {
+			errno = EPIPE;
+			return 0;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_put_,
+		&queue->cond_can_put_, ret);
+	return ret;
+}
+
+static _Bool bq_ring_put_timed(struct bq *queue, void *raw,
+	const struct timespec *deadline)
+{
+	_Bool ret = bq_ring_offer(queue, raw);
+	if (!ret && bq_spin(queue, bq_can_put))
+		ret = bq_ring_offer(queue, raw);
+	if (!ret) {
+		int err = 0;
+
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_put, queue);
+		atomic_fetch_add(&queue->nr_parked_put_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(ret = bq_ring_offer(queue, raw)) &&
+				!bq_closed(queue) && err != ETIMEDOUT)
+			err = bq_cond_timedwait(queue,
+				&queue->cond_can_put_, deadline, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_put */
+
+		if (!ret) {
+			errno = bq_closed(queue) ? EPIPE : ETIMEDOUT;
+			return 0;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_take_,
+		&queue->cond_can_take_, 1);
+	return 1;
+}
+
+static void *bq_ring_take_timed(struct bq *queue,
+	const struct timespec *deadline)
+{
+	void *raw = bq_ring_poll(queue);
+	if (!raw && bq_spin(queue, bq_can_take))
+		raw = bq_ring_poll(queue);
+	if (!raw) {
+		int err = 0;
+
+		pthread_mutex_lock(&queue->mutex_);
+		pthread_cleanup_push(bq_ring_unpark_take, queue);
+		atomic_fetch_add(&queue->nr_parked_take_, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		_Bool parked = 0;
+		while (!(raw = bq_ring_poll(queue)) &&
+				!bq_closed(queue) && err != ETIMEDOUT)
+			err = bq_cond_timedwait(queue,
+				&queue->cond_can_take_, deadline, &parked);
+
+		pthread_cleanup_pop_exec(); /* bq_ring_unpark_take */
+
+		/* an element may have been put just before closed */
+		if (!raw && bq_closed(queue)) {
+			bq_ring_wait_puts(queue);
+			raw = bq_ring_poll(queue);
+		}
+		if (!raw) {
+			errno = bq_closed(queue) ? EPIPE : ETIMEDOUT;
+			return NULL;
+		}
+	}
+
+	bq_ring_wake(queue, &queue->nr_parked_put_, &queue->cond_can_put_, 1);
+	return raw;
 }
@@ -1,6 +1,9 @@
 #ifndef BLOCKING_QUEUE_H
 #define BLOCKING_QUEUE_H
 
+#include <stdint.h>
+#include <time.h>
+
 /**
  * A blocking queue (opaque type).
  */
@@ -14,18 +17,148 @@ struct bq;
  */
 struct bq *bq_new(int capacity);
 
+/**
+ * How a blocking queue stores its elements.
+ */
+enum bq_backend {
+	BQ_BACKEND_MUTEX, /* a ring buffer guarded by a mutex, as bq_new() */
+	BQ_BACKEND_MPMC, /* a lock-free ring buffer, as bq_new_mpmc() */
+	BQ_BACKEND_SPSC, /* a wait-free ring buffer, as bq_new_spsc() */
+};
+
+/**
+ * Attributes of a blocking queue.
+ *
+ * A thread about to block checks a blocking queue "nr_spins" times with a
+ * CPU pause in between, then "nr_yields" times with sched_yield(), before
+ * it parks itself on a condition variable. Spinning saves a futex call
+ * and a context switch if the other side is about to come soon.
+ *
+ * If "use_eventfd" is set, which only BQ_BACKEND_MUTEX supports, a
+ * blocking queue has eventfds to wait for it with poll() or epoll along
+ * with other file descriptors. See bq_take_eventfd() and bq_put_eventfd().
+ *
+ * If "numa_node" is not -1, which only BQ_BACKEND_MPMC and BQ_BACKEND_SPSC
+ * support, memory of the ring buffer is preferably allocated on that NUMA
+ * node as its pages are touched, which should be where the threads putting
+ * and taking elements run. It is not an error for a kernel without NUMA
+ * support, or not letting a process set a memory policy, to ignore that.
+ */
+struct bq_attr {
+	enum bq_backend backend;
+	int nr_spins;
+	int nr_yields;
+	_Bool use_eventfd;
+	int numa_node;
+};
+
+/**
+ * Initialize attributes with the defaults: BQ_BACKEND_MUTEX, neither
+ * spinning nor yielding, no eventfds, and any NUMA node.
+ */
+void bq_attr_init(struct bq_attr *attr);
+
+/**
+ * Create a new blocking queue with attributes.
+ *
+ * @param capacity should be greater than 0.
+ * @param attr may be NULL for the defaults.
+ * @return a pointer to a new blocking queue if success; NULL otherwise.
+ */
+struct bq *bq_new_attr(int capacity, const struct bq_attr *attr);
+
+/**
+ * Create a new lock-free blocking queue.
+ *
+ * Elements are stored in a ring buffer of "capacity" slots, each of which
+ * has a sequence number telling whether it is ready to be put or taken
+ * as in Dmitry Vyukov's bounded MPMC queue. Producers and consumers never
+ * take a lock unless a queue is full or empty and they have to block.
+ * Otherwise it behaves the same as a queue created by bq_new().
+ *
+ * @param capacity should be greater than 0.
+ * @return a pointer to a new blocking queue if success; NULL otherwise.
+ */
+struct bq *bq_new_mpmc(int capacity);
+
+/**
+ * Create a new blocking queue for a single producer and a single consumer.
+ *
+ * It is wait-free unless it is full or empty, and puts and takes with
+ * neither locks nor read-modify-write operations. At most one thread may
+ * put, and at most one thread may take, at a time.
+ *
+ * @param capacity should be greater than 0.
+ * @return a pointer to a new blocking queue if success; NULL otherwise.
+ */
+struct bq *bq_new_spsc(int capacity);
+
 /**
  * Get the capacity of a blocking queue.
  */
 int bq_capacity(const struct bq *queue);
 
 /**
- * Get the number of elements in a blocking queue.
+ * Get the number of elements in a blocking queue without locking it.
  *
  * @param queue is conceptually const.
  */
 int bq_size(struct bq *queue);
 
+/**
+ * Get an eventfd which is readable while a blocking queue is not empty.
+ *
+ * It is for waiting to take an element without blocking in bq_take(),
+ * for example in epoll_wait() with sockets. A reader should not read the
+ * eventfd but take elements with bq_poll(), which may still return NULL if
+ * another thread takes first.
+ *
+ * @return an eventfd, or -1 if a blocking queue was not created with
+ * "use_eventfd".
+ */
+int bq_take_eventfd(const struct bq *queue);
+
+/**
+ * Get an eventfd which is readable while a blocking queue is not full.
+ * It is the counterpart of bq_take_eventfd() for bq_offer().
+ *
+ * @return an eventfd, or -1 if a blocking queue was not created with
+ * "use_eventfd".
+ */
+int bq_put_eventfd(const struct bq *queue);
+
+/**
+ * How many times threads about to block a blocking queue went on while
+ * spinning or yielding, and parked themselves.
+ */
+struct bq_wait_stats {
+	uint64_t nr_spun;
+	uint64_t nr_yielded;
+	uint64_t nr_parked;
+};
+
+void bq_get_wait_stats(struct bq *queue, struct bq_wait_stats *stats);
+
+/**
+ * Statistics of a blocking queue, which are read without locking it, so
+ * that monitoring them costs its producers and consumers nothing.
+ *
+ * For BQ_BACKEND_MPMC and BQ_BACKEND_SPSC, "nr_puts" and "nr_takes" are
+ * the positions reserved at either end of the ring, so that they include
+ * puts not published yet and takes not finished yet. A call which parks
+ * is counted once in "nr_put_blocks" or "nr_take_blocks", however many
+ * times it wakes up before it can go on.
+ */
+struct bq_stats {
+	uint64_t nr_puts; /* elements put */
+	uint64_t nr_takes; /* elements taken */
+	uint64_t nr_put_blocks; /* times producers parked while full */
+	uint64_t nr_take_blocks; /* times consumers parked while empty */
+	uint64_t wait_ns; /* nanoseconds threads spun, yielded, or parked */
+};
+
+void bq_get_stats(struct bq *queue, struct bq_stats *stats);
+
 /**
  * Insert a new element into tail of a blocking queue.
  *
@@ -34,14 +167,16 @@ int bq_size(struct bq *queue);
  *
  * A thread can be cancelled while it is blocked by bq_put().
  *
- * @return 1 if "element" is not NULL; 0 otherwise.
+ * @return 1 if "element" is not NULL and success; 0 otherwise, with errno
+ *         set to EPIPE if a blocking queue is closed.
  */
 _Bool bq_put(struct bq *queue, void *element);
 
 /**
  * Non-blocking version of bq_put().
  *
- * @return 1 if "element" is not NULL and success; 0 otherwise.
+ * @return 1 if "element" is not NULL and success; 0 otherwise, with errno
+ *         set to EPIPE if a blocking queue is closed.
  */
 _Bool bq_offer(struct bq *queue, void *element);
 
@@ -53,17 +188,115 @@ _Bool bq_offer(struct bq *queue, void *element);
  *
  * A thread can be cancelled while it is blocked by bq_take().
  *
- * @return non-NULL pointer to a taken element.
+ * @return non-NULL pointer to a taken element; NULL with errno set to
+ *         EPIPE if a blocking queue is closed and drained.
  */
 void *bq_take(struct bq *queue);
 
 /**
  * Non-blocking version of bq_take().
  *
- * @return non-NULL pointer to a taken element if success; NULL otherwise.
+ * @return non-NULL pointer to a taken element if success; NULL otherwise,
+ *         with errno set to EPIPE if a blocking queue is closed and drained.
  */
 void *bq_poll(struct bq *queue);
 
+/**
+ * Timed version of bq_put().
+ *
+ * If a blocking queue is full, bq_put_timed() blocks a calling thread
+ * until bq_take() removes an element or "deadline" passes.
+ *
+ * A thread can be cancelled while it is blocked by bq_put_timed().
+ *
+ * @param deadline is an absolute time of CLOCK_MONOTONIC.
+ * @return 1 if "element" is not NULL and success; 0 otherwise, with errno
+ *         set to ETIMEDOUT if "deadline" has passed, EPIPE if a blocking
+ *         queue is closed, or EINVAL if "deadline" is NULL or its tv_nsec
+ *         is out of [0, 1000000000).
+ */
+_Bool bq_put_timed(struct bq *queue, void *element,
+	const struct timespec *deadline);
+
+/**
+ * Timed version of bq_take().
+ *
+ * If a blocking queue is empty, bq_take_timed() blocks a calling thread
+ * until bq_put() inserts a new element or "deadline" passes.
+ *
+ * A thread can be cancelled while it is blocked by bq_take_timed().
+ *
+ * @param deadline is an absolute time of CLOCK_MONOTONIC.
+ * @return non-NULL pointer to a taken element if success; NULL otherwise,
+ *         with errno set to ETIMEDOUT, EPIPE if a blocking queue is
+ *         closed and drained, or EINVAL if "deadline" is invalid as
+ *         bq_put_timed() tells.
+ */
+void *bq_take_timed(struct bq *queue, const struct timespec *deadline);
+
+/**
+ * Insert elements into tail of a blocking queue at once.
+ *
+ * If a blocking queue is full, bq_put_many() blocks a calling thread
+ * until bq_take() or its variants remove an element. Then it inserts as
+ * many of "elements" in order as there is room for, and wakes threads
+ * waiting for them at once.
+ *
+ * A thread can be cancelled while it is blocked by bq_put_many().
+ *
+ * @param nr_elements is the number of "elements", none of which should
+ *        be NULL.
+ * @return the number of inserted elements, which is greater than 0 if
+ *         "nr_elements" is greater than 0 and success; 0 otherwise, with
+ *         errno set to EPIPE if a blocking queue is closed.
+ */
+int bq_put_many(struct bq *queue, void *const *elements, int nr_elements);
+
+/**
+ * Non-blocking version of bq_put_many().
+ *
+ * @return the number of inserted elements, which is 0 if a blocking queue
+ *         is full, or closed with errno set to EPIPE.
+ */
+int bq_offer_many(struct bq *queue, void *const *elements, int nr_elements);
+
+/**
+ * Get and remove elements from head of a blocking queue at once.
+ *
+ * If a blocking queue is empty, bq_take_many() blocks a calling thread
+ * until bq_put() or its variants insert an element. Then it removes up to
+ * "nr_elements" elements in order into "elements".
+ *
+ * A thread can be cancelled while it is blocked by bq_take_many().
+ *
+ * @return the number of taken elements, which is greater than 0 if
+ *         "nr_elements" is greater than 0, unless a blocking queue is closed
+ *         and drained, when errno is set to EPIPE.
+ */
+int bq_take_many(struct bq *queue, void **elements, int nr_elements);
+
+/**
+ * Non-blocking version of bq_take_many().
+ *
+ * @return the number of taken elements, which is 0 if a blocking queue is
+ *         empty, with errno set to EPIPE if it is also closed.
+ */
+int bq_poll_many(struct bq *queue, void **elements, int nr_elements);
+
+/**
+ * Close a blocking queue, telling consumers no more elements are coming.
+ *
+ * Once closed, putting fails at once, while taking gets elements left
+ * until a blocking queue is drained and then fails at once. Threads
+ * blocked by either are woken up at once, so that they need not be
+ * cancelled. Eventfds of a closed queue stay readable. Closing twice
+ * does nothing.
+ *
+ * A thread putting at the same time as bq_close() may or may not succeed,
+ * but an element put successfully is always taken before taking fails.
+ */
+void bq_close(struct bq *queue);
+
 /**
  * Destroy a blocking queue.
  *
@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "priority_blocking_queue.h"
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define pthread_cleanup_push_mutex_unlock(m) \
+	pthread_cleanup_push((void *)pthread_mutex_unlock, (m))
+
+#define pthread_cleanup_pop_exec() \
+	pthread_cleanup_pop(1)
+
+/* prototype */
+static void do_nothing(void *);
+static _Bool pbq_empty_unsafe(const struct pbq *);
+static _Bool pbq_full_unsafe(const struct pbq *);
+static _Bool pbq_insert_unsafe(struct pbq *, void *);
+static void *pbq_remove_unsafe(struct pbq *);
+static void pbq_wake_unsafe(pthread_cond_t *, int);
+
+/* elements a queue has room for at first, unless its capacity is less */
+#define PBQ_INITIAL_ELEMS 64
+
+/* children of each node of a heap */
+#define PBQ_ARITY 4
+
+struct pbq {
+	int size_;
+	int capacity_;
+	void **elems_; /* a heap of "size_" out of "nr_elems_" elements */
+	int nr_elems_;
+	int (*cmpr_)(const void *, const void *);
+	_Bool closed_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_can_put_;
+	pthread_cond_t cond_can_take_;
+};
+
+struct pbq *pbq_new(int capacity, int (*cmpr)(const void *, const void *))
+{
+	if (unlikely(!cmpr)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (unlikely(capacity <= 0))
+		return NULL;
+
+	struct pbq *const queue = malloc(sizeof(struct pbq));
+	if (unlikely(!queue))
+		return NULL;
+
+	const int nr_elems =
+		(capacity < PBQ_INITIAL_ELEMS) ? capacity : PBQ_INITIAL_ELEMS;
+	queue->elems_ = malloc(sizeof(void *) * nr_elems);
+	if (unlikely(!queue->elems_)) {
+		free(queue);
+		return NULL;
+	}
+
+	queue->size_ = 0;
+	queue->capacity_ = capacity;
+	queue->nr_elems_ = nr_elems;
+	queue->cmpr_ = cmpr;
+	queue->closed_ = 0;
+	pthread_mutex_init(&queue->mutex_, NULL);
+	pthread_cond_init(&queue->cond_can_put_, NULL);
+	pthread_cond_init(&queue->cond_can_take_, NULL);
+	return queue;
+}
+
+int pbq_capacity(const struct pbq *queue)
+{
+	return queue->capacity_;
+}
+
+int pbq_size(struct pbq *queue)
+{
+	pthread_mutex_lock(&queue->mutex_);
+	const int ret = queue->size_;
+	pthread_mutex_unlock(&queue->mutex_);
+	return ret;
+}
+
+_Bool pbq_put(struct pbq *queue, void *raw)
+{
+	if (unlikely(!raw))
+		return 0;
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	_Bool ret = 0; /* assume failure */
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	while (pbq_full_unsafe(queue) && !queue->closed_)
+		pthread_cond_wait(&queue->cond_can_put_, &queue->mutex_);
+
+	if (queue->closed_) {
+		errno = EPIPE;
+	} else if (pbq_insert_unsafe(queue, raw)) {
+		ret = 1; /* success */
+		pthread_cond_signal(&queue->cond_can_take_);
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
+}
+
+_Bool pbq_offer(struct pbq *queue, void *raw)
+{
+	if (unlikely(!raw))
+		return 0;
+
+	_Bool ret = 0; /* assume failure */
+
+	pthread_mutex_lock(&queue->mutex_);
+
+	if (queue->closed_) {
+		errno = EPIPE;
+	} else if (!pbq_full_unsafe(queue) && pbq_insert_unsafe(queue, raw)) {
+		ret = 1; /* success */
+		pthread_cond_signal(&queue->cond_can_take_);
+	}
+
+	pthread_mutex_unlock(&queue->mutex_);
+	return ret;
+}
+
+void *pbq_take(struct pbq *queue)
+{
+	/*
+	 * "raw" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	void *raw = NULL;
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	while (pbq_empty_unsafe(queue) && !queue->closed_)
+		pthread_cond_wait(&queue->cond_can_take_, &queue->mutex_);
+
+	if (!pbq_empty_unsafe(queue)) {
+		raw = pbq_remove_unsafe(queue);
+		pthread_cond_signal(&queue->cond_can_put_);
+	} else {
+		errno = EPIPE; /* closed and drained */
+	}
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return raw;
+}
+
+void *pbq_poll(struct pbq *queue)
+{
+	void *raw = NULL; /* assume failure */
+
+	pthread_mutex_lock(&queue->mutex_);
+
+	if (!pbq_empty_unsafe(queue)) {
+		raw = pbq_remove_unsafe(queue); /* success */
+		pthread_cond_signal(&queue->cond_can_put_);
+	} else if (queue->closed_) {
+		errno = EPIPE;
+	}
+
+	pthread_mutex_unlock(&queue->mutex_);
+	return raw;
+}
+
+int pbq_take_many(struct pbq *queue, void **elems, int nr_elems)
+{
+	if (unlikely(nr_elems <= 0))
+		return 0;
+
+	/*
+	 * "ret" should be defined here because
+	 * pthread_cleanup_{push,pop} make a code block
+	 */
+	int ret = 0;
+
+	pthread_cleanup_push_mutex_unlock(&queue->mutex_);
+	pthread_mutex_lock(&queue->mutex_);
+	/* critical section >>> */
+
+	while (pbq_empty_unsafe(queue) && !queue->closed_)
+		pthread_cond_wait(&queue->cond_can_take_, &queue->mutex_);
+
+	while (ret < nr_elems && !pbq_empty_unsafe(queue))
+		elems[ret++] = pbq_remove_unsafe(queue);
+	pbq_wake_unsafe(&queue->cond_can_put_, ret);
+	if (ret == 0)
+		errno = EPIPE; /* closed and drained */
+
+	/* <<< critical section */
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+
+	return ret;
+}
+
+int pbq_poll_many(struct pbq *queue, void **elems, int nr_elems)
+{
+	if (unlikely(nr_elems <= 0))
+		return 0;
+
+	int ret = 0;
+
+	pthread_mutex_lock(&queue->mutex_);
+
+	while (ret < nr_elems && !pbq_empty_unsafe(queue))
+		elems[ret++] = pbq_remove_unsafe(queue);
+	pbq_wake_unsafe(&queue->cond_can_put_, ret);
+	if (ret == 0 && queue->closed_)
+		errno = EPIPE;
+
+	pthread_mutex_unlock(&queue->mutex_);
+	return ret;
+}
+
+void pbq_close(struct pbq *queue)
+{
+	pthread_mutex_lock(&queue->mutex_);
+	queue->closed_ = 1;
+	pthread_cond_broadcast(&queue->cond_can_put_);
+	pthread_cond_broadcast(&queue->cond_can_take_);
+	pthread_mutex_unlock(&queue->mutex_);
+}
+
+void pbq_destroy(struct pbq *queue, void (*dtor)(void *))
+{
+	if (!dtor)
+		dtor = do_nothing;
+
+	for (int i = 0; i < queue->size_; ++i)
+		dtor(queue->elems_[i]);
+	free(queue->elems_);
+
+	pthread_mutex_destroy(&queue->mutex_);
+	pthread_cond_destroy(&queue->cond_can_put_);
+	pthread_cond_destroy(&queue->cond_can_take_);
+	free(queue);
+}
+
+static void do_nothing(void *raw)
+{
+	(void)raw;
+}
+
+static void pbq_wake_unsafe(pthread_cond_t *cond, int nr_elems)
+{
+	if (nr_elems == 1)
+		pthread_cond_signal(cond);
+	else if (nr_elems > 1)
+		pthread_cond_broadcast(cond);
+}
+
+static inline _Bool pbq_empty_unsafe(const struct pbq *queue)
+{
+	return (queue->size_ <= 0);
+}
+
+static inline _Bool pbq_full_unsafe(const struct pbq *queue)
+{
+	return (queue->size_ >= queue->capacity_);
+}
+
+/*
+ * Double the room of a queue, up to its capacity.
+ */
+static _Bool pbq_grow_unsafe(struct pbq *queue)
+{
+	const int nr_elems = (queue->nr_elems_ <= queue->capacity_ / 2) ?
+		queue->nr_elems_ * 2 : queue->capacity_;
+	void **const elems = realloc(queue->elems_, sizeof(void *) * nr_elems);
+	if (unlikely(!elems))
+		return 0;
+
+	queue->elems_ = elems;
+	queue->nr_elems_ = nr_elems;
+	return 1;
+}
+
+/*
+ * Move a hole up from the last leaf while its parent comes after "raw",
+ * and put "raw" there.
+ */
+static _Bool pbq_insert_unsafe(struct pbq *queue, void *raw)
+{
+	if (unlikely(queue->size_ >= queue->nr_elems_) &&
+			!pbq_grow_unsafe(queue))
+		return 0;
+
+	void **const elems = queue->elems_;
+	int i = queue->size_++;
+	while (i > 0) {
+		const int parent = (i - 1) / PBQ_ARITY;
+		if (queue->cmpr_(elems[parent], raw) <= 0)
+			break;
+		elems[i] = elems[parent];
+		i = parent;
+	}
+	elems[i] = raw;
+	return 1;
+}
+
+/*
+ * Take the root, and move a hole down from it to the first of children
+ * while it comes before the last leaf, which is put there.
+ */
+static void *pbq_remove_unsafe(struct pbq *queue)
+{
+	void **const elems = queue->elems_;
+	void *const raw = elems[0];
+	void *const last = elems[--queue->size_];
+	const int size = queue->size_;
+
+	int i = 0;
+	for (;;) {
+		const int first_child = i * PBQ_ARITY + 1;
+		if (first_child >= size)
+			break;
+
+		const int end = (first_child + PBQ_ARITY < size) ?
+			first_child + PBQ_ARITY : size;
+		int min = first_child;
+		for (int c = first_child + 1; c < end; ++c) {
+			if (queue->cmpr_(elems[c], elems[min]) < 0)
+				min = c;
+		}
+
+		if (queue->cmpr_(last, elems[min]) <= 0)
+			break;
+		elems[i] = elems[min];
+		i = min;
+	}
+	elems[i] = last;
+	return raw;
+}
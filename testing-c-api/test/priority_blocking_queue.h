@@ -0,0 +1,109 @@
+#ifndef PRIORITY_BLOCKING_QUEUE_H
+#define PRIORITY_BLOCKING_QUEUE_H
+
+/**
+ * Priority blocking queue, which takes elements in order of priority
+ * instead of the order they are put in.
+ */
+struct pbq;
+
+/**
+ * Create a new priority blocking queue.
+ *
+ * Elements are kept in a 4-ary heap, so that putting and taking one of
+ * them compares O(log(size)) elements with fewer cache misses than a
+ * binary heap.
+ *
+ * @param capacity should be greater than 0.
+ * @param cmpr compares two elements as in qsort(). An element which
+ *        compares less than another is taken first. Elements which compare
+ *        equal are taken in no particular order.
+ * @return a pointer to a new priority blocking queue if success; NULL
+ *         otherwise, with errno set to EINVAL if "cmpr" is NULL.
+ */
+struct pbq *pbq_new(int capacity, int (*cmpr)(const void *, const void *));
+
+int pbq_capacity(const struct pbq *queue);
+
+int pbq_size(struct pbq *queue);
+
+/**
+ * Insert a new element into a priority blocking queue.
+ *
+ * If a priority blocking queue is full, pbq_put() blocks a calling thread
+ * until pbq_take() or its variants remove an element.
+ *
+ * A thread can be cancelled while it is blocked by pbq_put().
+ *
+ * @return 1 if "element" is not NULL and success; 0 otherwise, with errno
+ *         set to EPIPE if a priority blocking queue is closed.
+ */
+_Bool pbq_put(struct pbq *queue, void *element);
+
+/**
+ * Non-blocking version of pbq_put().
+ *
+ * @return 1 if "element" is not NULL and success; 0 otherwise, with errno
+ *         set to EPIPE if a priority blocking queue is closed.
+ */
+_Bool pbq_offer(struct pbq *queue, void *element);
+
+/**
+ * Get and remove the first element of a priority blocking queue.
+ *
+ * If a priority blocking queue is empty, pbq_take() blocks a calling
+ * thread until pbq_put() inserts a new element.
+ *
+ * A thread can be cancelled while it is blocked by pbq_take().
+ *
+ * @return non-NULL pointer to a taken element; NULL with errno set to
+ *         EPIPE if a priority blocking queue is closed and drained.
+ */
+void *pbq_take(struct pbq *queue);
+
+/**
+ * Non-blocking version of pbq_take().
+ *
+ * @return non-NULL pointer to a taken element if success; NULL otherwise,
+ *         with errno set to EPIPE if a priority blocking queue is closed
+ *         and drained.
+ */
+void *pbq_poll(struct pbq *queue);
+
+/**
+ * Get and remove up to "nr_elements" first elements of a priority blocking
+ * queue at once, in order into "elements".
+ *
+ * If a priority blocking queue is empty, pbq_take_many() blocks a calling
+ * thread until pbq_put() inserts a new element.
+ *
+ * A thread can be cancelled while it is blocked by pbq_take_many().
+ *
+ * @return the number of taken elements, which is greater than 0 if
+ *         "nr_elements" is greater than 0, unless a priority blocking queue
+ *         is closed and drained, when errno is set to EPIPE.
+ */
+int pbq_take_many(struct pbq *queue, void **elements, int nr_elements);
+
+/**
+ * Non-blocking version of pbq_take_many().
+ *
+ * @return the number of taken elements, which is 0 if a priority blocking
+ *         queue is empty, with errno set to EPIPE if it is also closed.
+ */
+int pbq_poll_many(struct pbq *queue, void **elements, int nr_elements);
+
+/**
+ * Close a priority blocking queue as bq_close() does.
+ */
+void pbq_close(struct pbq *queue);
+
+/**
+ * Destroy a priority blocking queue.
+ *
+ * @param dtor destroys each element in a priority blocking queue.
+ *        If you want to do nothing for each, give it NULL.
+ */
+void pbq_destroy(struct pbq *queue, void (*dtor)(void *));
+
+#endif /* PRIORITY_BLOCKING_QUEUE_H */
@@ -1,7 +1,12 @@
 #include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "blocking_queue.h"
@@ -10,6 +15,14 @@
 #include "checkutil-inl.h"
 #include "checkutil-pthread-inl.h"
 
+/* a constructor of queues to test */
+#ifndef BQ_NEW
+#define BQ_NEW bq_new
+#endif
+#ifndef BQ_BACKEND
+#define BQ_BACKEND BQ_BACKEND_MUTEX
+#endif
+
 #define bq_put_or_free(q_, p_) do {		\
 	pthread_cleanup_push_free((p_));	\
 	bq_put((q_), (p_));			\
@@ -72,11 +85,11 @@
 START_TEST(test_capacity)
 {
 	/* capacity should be greater than 0 */
-	assert_nullptr(bq_new(0));
-	assert_nullptr(bq_new(-1));
-	assert_nullptr(bq_new(INT_MIN));
+	assert_nullptr(BQ_NEW(0));
+	assert_nullptr(BQ_NEW(-1));
+	assert_nullptr(BQ_NEW(INT_MIN));
 
-	struct bq *const queue = bq_new(INT_MAX);
+	struct bq *const queue = BQ_NEW(INT_MAX);
 	assert_not_nullptr(queue);
 	ck_assert_int_eq(INT_MAX, bq_capacity(queue));
 	ck_assert_int_eq(0, bq_size(queue));
@@ -84,9 +97,31 @@ START_TEST(test_capacity)
 }
 END_TEST
 
+START_TEST(test_out_of_memory)
+{
+	/* address space too small for a ring of INT_MAX slots */
+	struct rlimit old;
+	ck_assert_int_eq(0, getrlimit(RLIMIT_AS, &old));
+	struct rlimit low = old;
+	if (low.rlim_max == RLIM_INFINITY || low.rlim_max > ((rlim_t)1 << 30))
+		low.rlim_cur = (rlim_t)1 << 30;
+	ck_assert_int_eq(0, setrlimit(RLIMIT_AS, &low));
+	struct bq *const queue = BQ_NEW(INT_MAX);
+	ck_assert_int_eq(0, setrlimit(RLIMIT_AS, &old));
+
+	/* the mutex backend grows its buffer as elements are put */
+	if (BQ_BACKEND == BQ_BACKEND_MUTEX) {
+		assert_not_nullptr(queue);
+		bq_destroy(queue, NULL);
+		return;
+	}
+	assert_nullptr(queue);
+}
+END_TEST
+
 START_TEST(test_fifo)
 {
-	struct bq *const queue = bq_new(3);
+	struct bq *const queue = BQ_NEW(3);
 	assert_not_nullptr(queue);
 	ck_assert_int_eq(3, bq_capacity(queue));
 	ck_assert_int_eq(0, bq_size(queue));
@@ -150,11 +185,42 @@ START_TEST(test_fifo)
 }
 END_TEST
 
+START_TEST(test_wrap_around)
+{
+	/* more than a queue has room for at first, wrapping around */
+	enum { N = 1000 };
+	static int elems[N];
+
+	struct bq *const queue = BQ_NEW(N);
+	assert_not_nullptr(queue);
+
+	for (int i = 0; i < N / 2; ++i)
+		ck_assert(bq_put(queue, &elems[i]));
+	for (int i = 0; i < N / 4; ++i)
+		ck_assert_ptr_eq(&elems[i], bq_take(queue));
+	for (int i = N / 2; i < N; ++i)
+		ck_assert(bq_put(queue, &elems[i]));
+	for (int i = 0; i < N / 4; ++i)
+		ck_assert(bq_offer(queue, &elems[i]));
+	ck_assert_int_eq(N, bq_size(queue));
+	ck_assert(!bq_offer(queue, &elems[0]));
+
+	for (int i = N / 4; i < N; ++i)
+		ck_assert_ptr_eq(&elems[i], bq_take(queue));
+	for (int i = 0; i < N / 4; ++i)
+		ck_assert_ptr_eq(&elems[i], bq_poll(queue));
+	ck_assert_int_eq(0, bq_size(queue));
+	assert_nullptr(bq_poll(queue));
+
+	bq_destroy(queue, NULL);
+}
+END_TEST
+
 static void *run_producer1(void *);
 static void *run_consumer1(void *);
 START_TEST(test_multithread1)
 {
-	struct bq *const queue = bq_new(CAPACITY);
+	struct bq *const queue = BQ_NEW(CAPACITY);
 	assert_not_nullptr(queue);
 
 	pthread_t p, c;
@@ -221,11 +287,81 @@ out0:
 	return ret;
 }
 
+static void *run_producer3(void *);
+static void *run_consumer3(void *);
+START_TEST(test_multithread_batch)
+{
+	struct bq *const queue = BQ_NEW(CAPACITY);
+	assert_not_nullptr(queue);
+
+	pthread_t p, c;
+
+	/* run consumer first */
+	assert_pthread_create(&c, run_consumer3, queue);
+	assert_pthread_create(&p, run_producer3, queue);
+
+	/* join producer first */
+	assert_pthread_join(C_OK, p);
+	assert_pthread_join(C_OK, c);
+
+	ck_assert_int_eq(0, bq_size(queue));
+	bq_destroy(queue, NULL);
+}
+END_TEST
+
+/* elements are 1, 2, ..., NR_LOOPS as pointers, in batches */
+static void *run_producer3(void *arg)
+{
+	struct bq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) goto out;
+
+	*ret = C_ERR;
+
+	void *elems[7];
+	for (intptr_t i = 0; i < NR_LOOPS; ) {
+		int n = 0;
+		for (; n < 7 && i + n < NR_LOOPS; ++n)
+			elems[n] = (void *)(i + n + 1);
+
+		const int put = bq_put_many(queue, elems, n);
+		if (put <= 0) goto out;
+		i += put;
+	}
+
+	*ret = C_OK;
+out:
+	return ret;
+}
+
+static void *run_consumer3(void *arg)
+{
+	struct bq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) goto out;
+
+	*ret = C_ERR;
+
+	void *elems[5];
+	for (intptr_t i = 0; i < NR_LOOPS; ) {
+		const int n = bq_take_many(queue, elems, 5);
+		for (int j = 0; j < n; ++j, ++i) {
+			if (elems[j] != (void *)(i + 1)) goto out;
+		}
+	}
+
+	*ret = C_OK;
+out:
+	return ret;
+}
+
 static void *run_producer2(void *);
 static void *run_consumer2(void *);
 START_TEST(test_multithread2)
 {
-	struct bq *const queue = bq_new(CAPACITY);
+	struct bq *const queue = BQ_NEW(CAPACITY);
 	assert_not_nullptr(queue);
 
 	pthread_t p[NR_PRODUCERS], c[NR_CONSUMERS];
@@ -277,13 +413,198 @@ static void *run_consumer2(void *arg)
 	return arg; /* should never be here */
 }
 
+static atomic_long nr_put_, nr_taken_;
+
+static void *run_put_until_closed(void *);
+static void *run_take_until_closed(void *);
+START_TEST(test_close_race)
+{
+	enum { NR_ROUNDS = 200 };
+
+	/* no element put successfully is left once consumers get EPIPE */
+	for (int round = 0; round < NR_ROUNDS; ++round) {
+		struct bq *const queue = BQ_NEW(CAPACITY);
+		assert_not_nullptr(queue);
+		atomic_store(&nr_put_, 0);
+		atomic_store(&nr_taken_, 0);
+
+		pthread_t p[NR_PRODUCERS], c[NR_CONSUMERS];
+		for (size_t i = 0; i < NR_CONSUMERS; ++i)
+			assert_pthread_create(&c[i], run_take_until_closed,
+				queue);
+		for (size_t i = 0; i < NR_PRODUCERS; ++i)
+			assert_pthread_create(&p[i], run_put_until_closed,
+				queue);
+
+		usleep(round % 10 * 100);
+		bq_close(queue);
+		for (size_t i = 0; i < NR_PRODUCERS; ++i)
+			assert_pthread_join(C_OK, p[i]);
+		for (size_t i = 0; i < NR_CONSUMERS; ++i)
+			assert_pthread_join(C_OK, c[i]);
+
+		ck_assert_int_eq(atomic_load(&nr_put_),
+			atomic_load(&nr_taken_));
+		ck_assert_int_eq(0, bq_size(queue));
+		bq_destroy(queue, NULL);
+	}
+}
+END_TEST
+
+static void *run_put_until_closed(void *arg)
+{
+	struct bq *const queue = arg;
+	static int elem = 'E';
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	while (bq_put(queue, &elem))
+		atomic_fetch_add(&nr_put_, 1);
+	*ret = (errno == EPIPE) ? C_OK : C_ERR;
+	return ret;
+}
+
+static void *run_take_until_closed(void *arg)
+{
+	struct bq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	while (bq_take(queue))
+		atomic_fetch_add(&nr_taken_, 1);
+	*ret = (errno == EPIPE) ? C_OK : C_ERR;
+	return ret;
+}
+
+/* return the events ready in "epfd" without waiting */
+static uint64_t ready_events(int epfd)
+{
+	struct epoll_event events[2];
+	const int n = epoll_wait(epfd, events, 2, 0);
+	ck_assert_int_ge(n, 0);
+
+	uint64_t ret = 0;
+	for (int i = 0; i < n; ++i)
+		ret |= events[i].data.u64;
+	return ret;
+}
+
+enum { CAN_TAKE = 1, CAN_PUT = 2 };
+
+static void *run_epoll_take(void *arg);
+START_TEST(test_eventfd)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND;
+	attr.use_eventfd = 1;
+	struct bq *const queue = bq_new_attr(2, &attr);
+	if (BQ_BACKEND != BQ_BACKEND_MUTEX) {
+		assert_nullptr(queue);
+		return;
+	}
+	assert_not_nullptr(queue);
+
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	assert_not_failure(epfd);
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.u64 = CAN_TAKE;
+	assert_success(epoll_ctl(
+		epfd, EPOLL_CTL_ADD, bq_take_eventfd(queue), &event));
+	event.data.u64 = CAN_PUT;
+	assert_success(epoll_ctl(
+		epfd, EPOLL_CTL_ADD, bq_put_eventfd(queue), &event));
+
+	/* eventfds follow whether a queue is empty or full */
+	int a = 'A', b = 'B', c = 'C';
+	ck_assert_uint_eq(CAN_PUT, ready_events(epfd));
+	ck_assert(bq_offer(queue, &a));
+	ck_assert_uint_eq(CAN_TAKE | CAN_PUT, ready_events(epfd));
+	ck_assert(bq_offer(queue, &b));
+	ck_assert_uint_eq(CAN_TAKE, ready_events(epfd));
+	ck_assert_ptr_eq(&a, bq_poll(queue));
+	ck_assert_uint_eq(CAN_TAKE | CAN_PUT, ready_events(epfd));
+	ck_assert_ptr_eq(&b, bq_poll(queue));
+	ck_assert_uint_eq(CAN_PUT, ready_events(epfd));
+
+	void *elems[] = {&a, &b, &c};
+	ck_assert_int_eq(2, bq_offer_many(queue, elems, 3));
+	ck_assert_uint_eq(CAN_TAKE, ready_events(epfd));
+	ck_assert_int_eq(2, bq_poll_many(queue, elems, 3));
+	ck_assert_uint_eq(CAN_PUT, ready_events(epfd));
+
+	/* a consumer is waiting in epoll_wait() for a producer */
+	pthread_t t;
+	assert_pthread_create(&t, run_epoll_take, queue);
+	usleep(10 * 1000);
+	assert_put(queue, 'A');
+	assert_pthread_join('A', t);
+
+	/* and are readable once closed */
+	bq_close(queue);
+	ck_assert_uint_eq(CAN_TAKE | CAN_PUT, ready_events(epfd));
+
+	assert_success(close(epfd));
+	bq_destroy(queue, NULL);
+}
+END_TEST
+
+START_TEST(test_numa_node)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND;
+	attr.numa_node = -2;
+	assert_nullptr(bq_new_attr(2, &attr));
+	attr.numa_node = INT_MAX;
+	assert_nullptr(bq_new_attr(2, &attr));
+
+	/* node 0 is there if NUMA is not */
+	attr.numa_node = 0;
+	struct bq *const queue = bq_new_attr(2, &attr);
+	if (BQ_BACKEND == BQ_BACKEND_MUTEX) {
+		assert_nullptr(queue);
+		return;
+	}
+	assert_not_nullptr(queue);
+
+	int a = 'A';
+	ck_assert(bq_offer(queue, &a));
+	ck_assert_ptr_eq(&a, bq_poll(queue));
+	bq_destroy(queue, NULL);
+}
+END_TEST
+
+static void *run_epoll_take(void *arg)
+{
+	struct bq *const queue = arg;
+
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return NULL;
+
+	void *raw = NULL;
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	const int efd = bq_take_eventfd(queue);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &event) == 0 &&
+			epoll_wait(epfd, &event, 1, -1) == 1)
+		raw = bq_poll(queue);
+
+	close(epfd);
+	return raw;
+}
+
 /* testcase 2 */
 
 static struct bq *queue_ = NULL;
 
 static void setup(void)
 {
-	queue_ = bq_new(3);
+	queue_ = BQ_NEW(3);
 	assert_not_nullptr(queue_);
 	ck_assert_int_eq(3, bq_capacity(queue_));
 	ck_assert_int_eq(0, bq_size(queue_));
@@ -408,13 +729,383 @@ START_TEST(test_nonblock)
 }
 END_TEST
 
+START_TEST(test_batch_nonblock)
+{
+	int a = 'A', b = 'B', c = 'C', d = 'D';
+	void *in[] = { &a, &b, &c, &d };
+	void *out[4] = { NULL };
+
+	/* NULL cannot be put in any of elements */
+	void *with_null[] = { &a, NULL };
+	ck_assert_int_eq(0, bq_offer_many(queue_, with_null, 2));
+	ck_assert_int_eq(0, bq_put_many(queue_, with_null, 2));
+	ck_assert_int_eq(0, bq_size(queue_));
+
+	ck_assert_int_eq(0, bq_poll_many(queue_, out, 4));
+	ck_assert_int_eq(0, bq_offer_many(queue_, in, 0));
+
+	/* as many as there is room for */
+	ck_assert_int_eq(1, bq_offer_many(queue_, in, 1));
+	ck_assert_int_eq(2, bq_offer_many(queue_, &in[1], 3));
+	ck_assert_int_eq(3, bq_size(queue_));
+	ck_assert_int_eq(0, bq_offer_many(queue_, &in[3], 1));
+
+	ck_assert_int_eq(2, bq_poll_many(queue_, out, 2));
+	ck_assert_ptr_eq(&a, out[0]);
+	ck_assert_ptr_eq(&b, out[1]);
+	ck_assert_int_eq(1, bq_size(queue_));
+
+	ck_assert_int_eq(1, bq_offer_many(queue_, &in[3], 1));
+
+	/* as many as there are */
+	ck_assert_int_eq(2, bq_poll_many(queue_, out, 4));
+	ck_assert_ptr_eq(&c, out[0]);
+	ck_assert_ptr_eq(&d, out[1]);
+	ck_assert_int_eq(0, bq_size(queue_));
+}
+END_TEST
+
+static void *run_take_many(void *arg);
+static void *run_put_many(void *arg);
+START_TEST(test_batch_block)
+{
+	pthread_t t;
+
+	/* a thread blocked by bq_take_many() can be canceled */
+	assert_pthread_create(&t, run_take_many, queue_);
+	assert_pthread_cancel(t);
+	ck_assert_int_eq(0, bq_size(queue_));
+
+	/* bq_take_many() is waiting for bq_put() */
+	assert_pthread_create(&t, run_take_many, queue_);
+	assert_put(queue_, 'A');
+	assert_pthread_join('A', t);
+
+	/* bq_put_many() is waiting for bq_take() */
+	assert_put_unsafe(queue_, 'B', 1);
+	assert_put_unsafe(queue_, 'C', 2);
+	assert_put_unsafe(queue_, 'D', 3);
+	assert_pthread_create(&t, run_put_many, queue_);
+	assert_take(queue_, 'B');
+	assert_pthread_join(1, t); /* only one of two is put */
+	ck_assert_int_eq(3, bq_size(queue_));
+
+	assert_take_unsafe(queue_, 'C', 2);
+	assert_take_unsafe(queue_, 'D', 1);
+	assert_take_unsafe(queue_, 'E', 0);
+}
+END_TEST
+
+static void *run_take_many(void *arg)
+{
+	struct bq *const queue = arg;
+	void *elems[2] = { NULL };
+	const int n = bq_take_many(queue, elems, 2); /* cancellation point */
+	return (n == 1) ? elems[0] : NULL;
+}
+
+static void *run_put_many(void *arg)
+{
+	struct bq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) goto out0;
+	pthread_cleanup_push_free(ret);
+
+	*ret = C_ERR;
+
+	int *const p = malloc(sizeof(int));
+	if (!p) goto out1;
+
+	*p = 'E';
+	pthread_cleanup_push_free(p);
+	void *const elems[] = { p, p };
+	*ret = bq_put_many(queue, elems, 2); /* cancellation point */
+	pthread_cleanup_pop_noexec();
+
+out1:
+	pthread_cleanup_pop_noexec();
+out0:
+	return ret;
+}
+
+/* a deadline "ms" milliseconds later, and milliseconds since "start" */
+
+static struct timespec deadline_after(long ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void *run_take_timed(void *arg);
+START_TEST(test_timed)
+{
+	struct timespec start, deadline;
+
+	/* bq_take_timed() gives up at a deadline */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_after(50);
+	assert_error(ETIMEDOUT, 0, bq_take_timed(queue_, &deadline));
+	ck_assert_int_ge(elapsed_ms(&start), 50);
+
+	/* an invalid deadline fails at once rather than spinning */
+	int x = 'X';
+	deadline.tv_nsec = 1000000000L;
+	assert_error(EINVAL, 0, bq_take_timed(queue_, &deadline));
+	assert_error(EINVAL, 0, bq_put_timed(queue_, &x, &deadline));
+	deadline.tv_nsec = -1;
+	assert_error(EINVAL, 0, bq_take_timed(queue_, &deadline));
+	assert_error(EINVAL, 0, bq_put_timed(queue_, &x, &deadline));
+	assert_error(EINVAL, 0, bq_take_timed(queue_, NULL));
+	ck_assert_int_eq(0, bq_size(queue_));
+
+	/* bq_take_timed() is waiting for bq_put() */
+	pthread_t t;
+	assert_pthread_create(&t, run_take_timed, queue_);
+	assert_put(queue_, 'A');
+	assert_pthread_join('A', t);
+
+	/* bq_put_timed() gives up at a deadline */
+	int a = 'A', b = 'B', c = 'C', d = 'D';
+	deadline = deadline_after(0);
+	ck_assert(bq_put_timed(queue_, &a, &deadline));
+	ck_assert(bq_put_timed(queue_, &b, &deadline));
+	ck_assert(bq_put_timed(queue_, &c, &deadline));
+	ck_assert_int_eq(3, bq_size(queue_));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_after(50);
+	assert_error(ETIMEDOUT, 0, bq_put_timed(queue_, &d, &deadline));
+	ck_assert_int_ge(elapsed_ms(&start), 50);
+	ck_assert_int_eq(3, bq_size(queue_));
+
+	/* and takes what there is even if a deadline has passed */
+	ck_assert_ptr_eq(&a, bq_take_timed(queue_, &deadline));
+	ck_assert_ptr_eq(&b, bq_take_timed(queue_, &deadline));
+	ck_assert_ptr_eq(&c, bq_take_timed(queue_, &deadline));
+	ck_assert_int_eq(0, bq_size(queue_));
+}
+END_TEST
+
+static void *run_take_timed(void *arg)
+{
+	struct bq *const queue = arg;
+	const struct timespec deadline = deadline_after(10000);
+	return bq_take_timed(queue, &deadline); /* cancellation point */
+}
+
+static void *run_take_end(void *arg);
+static void *run_put_end(void *arg);
+START_TEST(test_close)
+{
+	/* threads blocked by bq_take() are woken up */
+	pthread_t t1, t2;
+	assert_pthread_create(&t1, run_take_end, queue_);
+	assert_pthread_create(&t2, run_take_end, queue_);
+	usleep(10 * 1000);
+	bq_close(queue_);
+	bq_close(queue_);
+	assert_pthread_join(C_OK, t1);
+	assert_pthread_join(C_OK, t2);
+
+	/* putting fails at once */
+	int a = 'A';
+	void *elems[] = {&a};
+	assert_error(EPIPE, 0, bq_put(queue_, &a));
+	assert_error(EPIPE, 0, bq_offer(queue_, &a));
+	const struct timespec deadline = deadline_after(10000);
+	assert_error(EPIPE, 0, bq_put_timed(queue_, &a, &deadline));
+	assert_error(EPIPE, 0, bq_put_many(queue_, elems, 1));
+	assert_error(EPIPE, 0, bq_offer_many(queue_, elems, 1));
+	ck_assert_int_eq(0, bq_size(queue_));
+}
+END_TEST
+
+START_TEST(test_close_drain)
+{
+	assert_put_unsafe(queue_, 'A', 1);
+	assert_put_unsafe(queue_, 'B', 2);
+	assert_put_unsafe(queue_, 'C', 3);
+
+	/* a thread blocked by bq_put() is woken up */
+	pthread_t t;
+	assert_pthread_create(&t, run_put_end, queue_);
+	usleep(10 * 1000);
+	bq_close(queue_);
+	assert_pthread_join(C_OK, t);
+
+	/* taking gets elements left, and then fails at once */
+	assert_take_unsafe(queue_, 'A', 2);
+	int *p = bq_poll(queue_);
+	assert_not_nullptr(p);
+	ck_assert_int_eq('B', *p);
+	free(p);
+	void *elems[2];
+	ck_assert_int_eq(1, bq_take_many(queue_, elems, 2));
+	ck_assert_int_eq('C', *(int *)elems[0]);
+	free(elems[0]);
+
+	const struct timespec deadline = deadline_after(10000);
+	assert_error(EPIPE, 0, bq_take(queue_));
+	assert_error(EPIPE, 0, bq_poll(queue_));
+	assert_error(EPIPE, 0, bq_take_timed(queue_, &deadline));
+	assert_error(EPIPE, 0, bq_take_many(queue_, elems, 2));
+	assert_error(EPIPE, 0, bq_poll_many(queue_, elems, 2));
+}
+END_TEST
+
+static void *run_take_end(void *arg)
+{
+	struct bq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = (!bq_take(queue) && errno == EPIPE) ? C_OK : C_ERR;
+	return ret;
+}
+
+static void *run_put_end(void *arg)
+{
+	struct bq *const queue = arg;
+	static int elem = 'D';
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = (!bq_put(queue, &elem) && errno == EPIPE) ? C_OK : C_ERR;
+	return ret;
+}
+
+START_TEST(test_stats)
+{
+	struct bq_stats stats;
+	bq_get_stats(queue_, &stats);
+	ck_assert_uint_eq(0, stats.nr_puts);
+	ck_assert_uint_eq(0, stats.nr_takes);
+	ck_assert_uint_eq(0, stats.nr_put_blocks);
+	ck_assert_uint_eq(0, stats.nr_take_blocks);
+	ck_assert_uint_eq(0, stats.wait_ns);
+
+	assert_put(queue_, 'A');
+	assert_put(queue_, 'B');
+	assert_take(queue_, 'A');
+	bq_get_stats(queue_, &stats);
+	ck_assert_uint_eq(2, stats.nr_puts);
+	ck_assert_uint_eq(1, stats.nr_takes);
+	ck_assert_uint_eq(0, stats.nr_put_blocks);
+	ck_assert_uint_eq(0, stats.nr_take_blocks);
+
+	/* a consumer blocks while empty */
+	assert_take(queue_, 'B');
+	pthread_t t;
+	assert_pthread_create(&t, run_take_timed, queue_);
+	usleep(20 * 1000);
+	assert_put(queue_, 'C');
+	assert_pthread_join('C', t);
+	bq_get_stats(queue_, &stats);
+	ck_assert_uint_eq(3, stats.nr_puts);
+	ck_assert_uint_eq(3, stats.nr_takes);
+	ck_assert_uint_eq(0, stats.nr_put_blocks);
+	ck_assert_uint_eq(1, stats.nr_take_blocks);
+	ck_assert_uint_ge(stats.wait_ns, 10 * 1000 * 1000);
+
+	/* and a producer blocks while full */
+	assert_put(queue_, 'A');
+	assert_put(queue_, 'B');
+	assert_put(queue_, 'C');
+	assert_pthread_create(&t, run_put, queue_);
+	usleep(20 * 1000);
+	assert_take(queue_, 'A');
+	assert_pthread_join(C_OK, t);
+	bq_get_stats(queue_, &stats);
+	ck_assert_uint_eq(7, stats.nr_puts);
+	ck_assert_uint_eq(4, stats.nr_takes);
+	ck_assert_uint_eq(1, stats.nr_put_blocks);
+	ck_assert_uint_ge(stats.wait_ns, 20 * 1000 * 1000);
+}
+END_TEST
+
+/* take an element put 20 ms later with a wait policy */
+static void take_later(int nr_spins, int nr_yields,
+	struct bq_wait_stats *stats)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND;
+	attr.nr_spins = nr_spins;
+	attr.nr_yields = nr_yields;
+	struct bq *const queue = bq_new_attr(1, &attr);
+	assert_not_nullptr(queue);
+
+	pthread_t t;
+	assert_pthread_create(&t, run_take, queue);
+	usleep(20 * 1000);
+	assert_put(queue, 'A');
+	assert_pthread_join('A', t);
+
+	bq_get_wait_stats(queue, stats);
+	bq_destroy(queue, NULL);
+}
+
+START_TEST(test_wait_policy)
+{
+	struct bq_attr attr;
+	bq_attr_init(&attr);
+	attr.backend = BQ_BACKEND;
+	attr.nr_spins = -1;
+	assert_nullptr(bq_new_attr(1, &attr));
+
+	struct bq_wait_stats stats;
+
+	/* block at once */
+	take_later(0, 0, &stats);
+	ck_assert_uint_eq(0, stats.nr_spun);
+	ck_assert_uint_eq(0, stats.nr_yielded);
+	ck_assert_uint_ge(stats.nr_parked, 1);
+
+	/* spin long enough */
+	take_later(INT_MAX, 0, &stats);
+	ck_assert_uint_eq(1, stats.nr_spun);
+	ck_assert_uint_eq(0, stats.nr_yielded);
+	ck_assert_uint_eq(0, stats.nr_parked);
+
+	/* yield long enough */
+	take_later(0, INT_MAX, &stats);
+	ck_assert_uint_eq(0, stats.nr_spun);
+	ck_assert_uint_eq(1, stats.nr_yielded);
+	ck_assert_uint_eq(0, stats.nr_parked);
+}
+END_TEST
+
 int main()
 {
 	TCase *const tcase1 = tcase_create("testcase1");
 	tcase_add_test(tcase1, test_capacity);
+	tcase_add_test(tcase1, test_out_of_memory);
 	tcase_add_test(tcase1, test_fifo);
+	tcase_add_test(tcase1, test_wrap_around);
 	tcase_add_test(tcase1, test_multithread1);
 	tcase_add_test(tcase1, test_multithread2);
+	tcase_add_test(tcase1, test_multithread_batch);
+	tcase_add_test(tcase1, test_close_race);
+	tcase_add_test(tcase1, test_eventfd);
+	tcase_add_test(tcase1, test_numa_node);
 
 	TCase *const tcase2 = tcase_create("testcase2");
 	tcase_add_checked_fixture(tcase2, setup, teardown);
@@ -422,6 +1113,13 @@ int main()
 	tcase_add_test(tcase2, test_null_element);
 	tcase_add_test(tcase2, test_block);
 	tcase_add_test(tcase2, test_nonblock);
+	tcase_add_test(tcase2, test_batch_nonblock);
+	tcase_add_test(tcase2, test_batch_block);
+	tcase_add_test(tcase2, test_timed);
+	tcase_add_test(tcase2, test_wait_policy);
+	tcase_add_test(tcase2, test_close);
+	tcase_add_test(tcase2, test_close_drain);
+	tcase_add_test(tcase2, test_stats);
 
 	Suite *const suite = suite_create("blocking_queue");
 	suite_add_tcase(suite, tcase1);
@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "priority_blocking_queue.h"
+
+#include <check.h>
+#include "checkutil-inl.h"
+#include "checkutil-pthread-inl.h"
+
+/* elements are integers in pointers */
+#define ELEM(i_) ((void *)(intptr_t)(i_))
+
+static int elem_comparator(const void *lhs, const void *rhs)
+{
+	const intptr_t a = (intptr_t)lhs;
+	const intptr_t b = (intptr_t)rhs;
+	return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+START_TEST(test_capacity)
+{
+	assert_nullptr(pbq_new(0, elem_comparator));
+	assert_nullptr(pbq_new(-1, elem_comparator));
+	assert_error(EINVAL, 0, pbq_new(1, NULL));
+
+	struct pbq *const queue = pbq_new(INT_MAX, elem_comparator);
+	assert_not_nullptr(queue);
+	ck_assert_int_eq(INT_MAX, pbq_capacity(queue));
+	ck_assert_int_eq(0, pbq_size(queue));
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+START_TEST(test_order)
+{
+	enum { N = 1000 };
+	struct pbq *const queue = pbq_new(N, elem_comparator);
+	assert_not_nullptr(queue);
+
+	/* put a permutation of 1 to N, some of which twice */
+	for (int i = 0; i < N / 2; ++i)
+		ck_assert(pbq_offer(queue, ELEM((i * 7919) % N + 1)));
+	for (int i = 0; i < N / 2; ++i)
+		ck_assert(pbq_put(queue, ELEM((i * 7919) % (N / 2) + 1)));
+	ck_assert(!pbq_offer(queue, ELEM(1)));
+	ck_assert_int_eq(N, pbq_size(queue));
+
+	/* and take them in ascending order */
+	intptr_t last = 0;
+	for (int i = 0; i < N; ++i) {
+		const intptr_t elem = (intptr_t)pbq_take(queue);
+		ck_assert_int_le(last, elem);
+		last = elem;
+	}
+	assert_nullptr(pbq_poll(queue));
+	ck_assert_int_eq(0, pbq_size(queue));
+
+	/* higher priority ones overtake lower ones put before */
+	ck_assert(pbq_put(queue, ELEM(30)));
+	ck_assert(pbq_put(queue, ELEM(20)));
+	ck_assert_ptr_eq(ELEM(20), pbq_poll(queue));
+	ck_assert(pbq_put(queue, ELEM(10)));
+	ck_assert(pbq_put(queue, ELEM(40)));
+	ck_assert_ptr_eq(ELEM(10), pbq_take(queue));
+	ck_assert_ptr_eq(ELEM(30), pbq_take(queue));
+	ck_assert_ptr_eq(ELEM(40), pbq_take(queue));
+
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+START_TEST(test_take_many)
+{
+	struct pbq *const queue = pbq_new(10, elem_comparator);
+	assert_not_nullptr(queue);
+
+	void *elems[4] = {NULL};
+	ck_assert_int_eq(0, pbq_poll_many(queue, elems, 4));
+	ck_assert_int_eq(0, pbq_take_many(queue, elems, 0));
+
+	for (int i = 10; i > 0; --i)
+		ck_assert(pbq_put(queue, ELEM(i)));
+
+	/* the top K */
+	ck_assert_int_eq(4, pbq_take_many(queue, elems, 4));
+	for (int i = 0; i < 4; ++i)
+		ck_assert_ptr_eq(ELEM(i + 1), elems[i]);
+	ck_assert_int_eq(4, pbq_poll_many(queue, elems, 4));
+	for (int i = 0; i < 4; ++i)
+		ck_assert_ptr_eq(ELEM(i + 5), elems[i]);
+
+	/* or all there are */
+	ck_assert_int_eq(2, pbq_take_many(queue, elems, 4));
+	ck_assert_ptr_eq(ELEM(9), elems[0]);
+	ck_assert_ptr_eq(ELEM(10), elems[1]);
+	ck_assert_int_eq(0, pbq_size(queue));
+
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+static void *run_take(void *arg);
+static void *run_put(void *arg);
+START_TEST(test_block)
+{
+	struct pbq *const queue = pbq_new(2, elem_comparator);
+	assert_not_nullptr(queue);
+
+	/* pbq_take() is waiting for pbq_put() */
+	pthread_t t;
+	assert_pthread_create(&t, run_take, queue);
+	usleep(10 * 1000);
+	ck_assert(pbq_put(queue, ELEM(3)));
+	assert_pthread_join(3, t);
+
+	/* pbq_put() is waiting for pbq_take() */
+	ck_assert(pbq_put(queue, ELEM(2)));
+	ck_assert(pbq_put(queue, ELEM(3)));
+	assert_pthread_create(&t, run_put, queue);
+	usleep(10 * 1000);
+	ck_assert_int_eq(2, pbq_size(queue));
+	ck_assert_ptr_eq(ELEM(2), pbq_take(queue));
+	assert_pthread_join(C_OK, t);
+	ck_assert_ptr_eq(ELEM(1), pbq_take(queue));
+	ck_assert_ptr_eq(ELEM(3), pbq_take(queue));
+
+	/* a thread blocked by pbq_take() is cancellable */
+	assert_pthread_create(&t, run_take, queue);
+	usleep(10 * 1000);
+	assert_pthread_cancel(t);
+
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+static void *run_take(void *arg)
+{
+	struct pbq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = (int)(intptr_t)pbq_take(queue); /* cancellation point */
+	return ret;
+}
+
+static void *run_put(void *arg)
+{
+	struct pbq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = pbq_put(queue, ELEM(1)) ? C_OK : C_ERR;
+	return ret;
+}
+
+static void *run_producer(void *);
+static void *run_consumer(void *);
+START_TEST(test_multithread)
+{
+	struct pbq *const queue = pbq_new(CAPACITY, elem_comparator);
+	assert_not_nullptr(queue);
+
+	pthread_t p[NR_PRODUCERS], c[NR_CONSUMERS];
+	for (size_t i = 0; i < NR_CONSUMERS; ++i)
+		assert_pthread_create(&c[i], run_consumer, queue);
+	for (size_t i = 0; i < NR_PRODUCERS; ++i)
+		assert_pthread_create(&p[i], run_producer, queue);
+
+	for (size_t i = 0; i < NR_PRODUCERS; ++i)
+		assert_pthread_join(C_OK, p[i]);
+	pbq_close(queue);
+
+	/* consumers have taken every element once */
+	long long sum = 0;
+	for (size_t i = 0; i < NR_CONSUMERS; ++i) {
+		void *r = NULL;
+		ck_assert_int_eq(0, pthread_join(c[i], &r));
+		assert_not_nullptr(r);
+		sum += *(long long *)r;
+		free(r);
+	}
+	const long long expected =
+		(long long)NR_PRODUCERS * NR_LOOPS * (NR_LOOPS + 1) / 2;
+	ck_assert_int_eq(expected, sum);
+	ck_assert_int_eq(0, pbq_size(queue));
+
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+static void *run_producer(void *arg)
+{
+	struct pbq *const queue = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = C_ERR;
+	for (intptr_t i = 1; i <= NR_LOOPS; ++i) {
+		if (!pbq_put(queue, ELEM(i)))
+			return ret;
+	}
+
+	*ret = C_OK;
+	return ret;
+}
+
+static void *run_consumer(void *arg)
+{
+	struct pbq *const queue = arg;
+
+	long long *const sum = malloc(sizeof(long long));
+	if (!sum) return NULL;
+
+	*sum = 0;
+	void *elems[8];
+	int n = 0;
+	while ((n = pbq_take_many(queue, elems, 8)) > 0) {
+		for (int i = 0; i < n; ++i)
+			*sum += (intptr_t)elems[i];
+	}
+	return sum;
+}
+
+START_TEST(test_close)
+{
+	struct pbq *const queue = pbq_new(2, elem_comparator);
+	assert_not_nullptr(queue);
+
+	ck_assert(pbq_put(queue, ELEM(2)));
+	ck_assert(pbq_put(queue, ELEM(1)));
+	pbq_close(queue);
+
+	/* putting fails, while taking drains in order and then fails */
+	assert_error(EPIPE, 0, pbq_put(queue, ELEM(3)));
+	assert_error(EPIPE, 0, pbq_offer(queue, ELEM(3)));
+	ck_assert_ptr_eq(ELEM(1), pbq_take(queue));
+	ck_assert_ptr_eq(ELEM(2), pbq_poll(queue));
+	void *elems[2];
+	assert_error(EPIPE, 0, pbq_take(queue));
+	assert_error(EPIPE, 0, pbq_poll(queue));
+	assert_error(EPIPE, 0, pbq_take_many(queue, elems, 2));
+	assert_error(EPIPE, 0, pbq_poll_many(queue, elems, 2));
+
+	pbq_destroy(queue, NULL);
+}
+END_TEST
+
+static int nr_destroyed_ = 0;
+
+static void count_destroyed(void *raw)
+{
+	(void)raw;
+	++nr_destroyed_;
+}
+
+START_TEST(test_dtor)
+{
+	struct pbq *const queue = pbq_new(10, elem_comparator);
+	assert_not_nullptr(queue);
+
+	for (int i = 1; i <= 5; ++i)
+		ck_assert(pbq_put(queue, ELEM(i)));
+	nr_destroyed_ = 0;
+	pbq_destroy(queue, count_destroyed);
+	ck_assert_int_eq(5, nr_destroyed_);
+}
+END_TEST
+
+int main()
+{
+	TCase *const tcase = tcase_create("testcase");
+	tcase_add_test(tcase, test_capacity);
+	tcase_add_test(tcase, test_order);
+	tcase_add_test(tcase, test_take_many);
+	tcase_add_test(tcase, test_block);
+	tcase_add_test(tcase, test_multithread);
+	tcase_add_test(tcase, test_close);
+	tcase_add_test(tcase, test_dtor);
+
+	Suite *const suite = suite_create("priority_blocking_queue");
+	suite_add_tcase(suite, tcase);
+
+	SRunner *const srunner = srunner_create(suite);
+	srunner_run_all(srunner, CK_NORMAL);
+	const int failed = srunner_ntests_failed(srunner);
+	srunner_free(srunner);
+
+	return !!failed;
+}
@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+#include <check.h>
+#include "checkutil-inl.h"
+#include "checkutil-pthread-inl.h"
+
+static atomic_llong sum_;
+
+static void add(void *arg)
+{
+	atomic_fetch_add(&sum_, (intptr_t)arg);
+}
+
+START_TEST(test_new)
+{
+	assert_nullptr(tp_new(0, CAPACITY));
+	assert_nullptr(tp_new(-1, CAPACITY));
+	assert_nullptr(tp_new(NR_WORKERS, 0));
+
+	struct tp *const pool = tp_new(NR_WORKERS, CAPACITY);
+	assert_not_nullptr(pool);
+	ck_assert_int_eq(NR_WORKERS, tp_nr_workers(pool));
+	ck_assert(!tp_submit(pool, NULL, NULL));
+
+	/* waiting for nothing returns at once */
+	tp_wait(pool);
+	tp_destroy(pool);
+}
+END_TEST
+
+START_TEST(test_submit)
+{
+	struct tp *const pool = tp_new(NR_WORKERS, CAPACITY);
+	assert_not_nullptr(pool);
+
+	/* more tasks than an injection queue has room for */
+	atomic_store(&sum_, 0);
+	for (intptr_t i = 1; i <= NR_LOOPS; ++i)
+		ck_assert(tp_submit(pool, add, (void *)i));
+	tp_wait(pool);
+	ck_assert_int_eq((long long)NR_LOOPS * (NR_LOOPS + 1) / 2,
+		atomic_load(&sum_));
+
+	/* and once again */
+	atomic_store(&sum_, 0);
+	for (intptr_t i = 1; i <= NR_LOOPS; ++i)
+		ck_assert(tp_submit(pool, add, (void *)i));
+	tp_wait(pool);
+	ck_assert_int_eq((long long)NR_LOOPS * (NR_LOOPS + 1) / 2,
+		atomic_load(&sum_));
+
+	tp_destroy(pool);
+}
+END_TEST
+
+static struct tp *pool_;
+
+/* submit two children down to leaves, each of which adds 1 */
+static void fork_join(void *arg)
+{
+	const intptr_t depth = (intptr_t)arg;
+	if (depth == 0) {
+		atomic_fetch_add(&sum_, 1);
+		return;
+	}
+	tp_submit(pool_, fork_join, (void *)(depth - 1));
+	tp_submit(pool_, fork_join, (void *)(depth - 1));
+}
+
+START_TEST(test_fork_join)
+{
+	enum { DEPTH = 16 };
+	pool_ = tp_new(NR_WORKERS, CAPACITY);
+	assert_not_nullptr(pool_);
+
+	/* tp_wait() waits for tasks submitted by tasks too */
+	atomic_store(&sum_, 0);
+	ck_assert(tp_submit(pool_, fork_join, (void *)(intptr_t)DEPTH));
+	tp_wait(pool_);
+	ck_assert_int_eq(1 << DEPTH, atomic_load(&sum_));
+
+	tp_destroy(pool_);
+}
+END_TEST
+
+enum { NR_CHILDREN = 100 };
+
+static atomic_int nr_children_;
+
+static void child(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_children_, 1);
+}
+
+/* wait for children pushed to its own deque, which others have to steal */
+static void parent(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < NR_CHILDREN; ++i)
+		tp_submit(pool_, child, NULL);
+	for (int i = 0; i < 10 * 1000; ++i) {
+		if (atomic_load(&nr_children_) == NR_CHILDREN) {
+			atomic_store(&sum_, 1);
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+START_TEST(test_steal)
+{
+	pool_ = tp_new(2, CAPACITY);
+	assert_not_nullptr(pool_);
+
+	atomic_store(&sum_, 0);
+	atomic_store(&nr_children_, 0);
+	ck_assert(tp_submit(pool_, parent, NULL));
+	tp_wait(pool_);
+	ck_assert_int_eq(1, atomic_load(&sum_));
+	ck_assert_int_eq(NR_CHILDREN, atomic_load(&nr_children_));
+
+	tp_destroy(pool_);
+}
+END_TEST
+
+static void *run_submitter(void *);
+START_TEST(test_multithread)
+{
+	struct tp *const pool = tp_new(NR_WORKERS, CAPACITY);
+	assert_not_nullptr(pool);
+
+	atomic_store(&sum_, 0);
+	pthread_t p[NR_PRODUCERS];
+	for (size_t i = 0; i < NR_PRODUCERS; ++i)
+		assert_pthread_create(&p[i], run_submitter, pool);
+	for (size_t i = 0; i < NR_PRODUCERS; ++i)
+		assert_pthread_join(C_OK, p[i]);
+	tp_wait(pool);
+
+	const long long expected =
+		(long long)NR_PRODUCERS * NR_LOOPS * (NR_LOOPS + 1) / 2;
+	ck_assert_int_eq(expected, atomic_load(&sum_));
+
+	tp_destroy(pool);
+}
+END_TEST
+
+static void *run_submitter(void *arg)
+{
+	struct tp *const pool = arg;
+
+	int *const ret = malloc(sizeof(int));
+	if (!ret) return NULL;
+
+	*ret = C_ERR;
+	for (intptr_t i = 1; i <= NR_LOOPS; ++i) {
+		if (!tp_submit(pool, add, (void *)i))
+			return ret;
+	}
+
+	*ret = C_OK;
+	return ret;
+}
+
+START_TEST(test_destroy)
+{
+	struct tp *const pool = tp_new(NR_WORKERS, CAPACITY);
+	assert_not_nullptr(pool);
+
+	/* tasks submitted are run before workers stop */
+	atomic_store(&sum_, 0);
+	for (intptr_t i = 1; i <= NR_LOOPS; ++i)
+		ck_assert(tp_submit(pool, add, (void *)i));
+	tp_destroy(pool);
+	ck_assert_int_eq((long long)NR_LOOPS * (NR_LOOPS + 1) / 2,
+		atomic_load(&sum_));
+}
+END_TEST
+
+int main()
+{
+	TCase *const tcase = tcase_create("testcase");
+	tcase_add_test(tcase, test_new);
+	tcase_add_test(tcase, test_submit);
+	tcase_add_test(tcase, test_fork_join);
+	tcase_add_test(tcase, test_steal);
+	tcase_add_test(tcase, test_multithread);
+	tcase_add_test(tcase, test_destroy);
+
+	Suite *const suite = suite_create("thread_pool");
+	suite_add_tcase(suite, tcase);
+
+	SRunner *const srunner = srunner_create(suite);
+	srunner_run_all(srunner, CK_NORMAL);
+	const int failed = srunner_ntests_failed(srunner);
+	srunner_free(srunner);
+
+	return !!failed;
+}
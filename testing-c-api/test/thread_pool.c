@@ -0,0 +1,481 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "blocking_queue.h"
+#include "thread_pool.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define pthread_cleanup_push_mutex_unlock(m) \
+	pthread_cleanup_push((void *)pthread_mutex_unlock, (m))
+
+#define pthread_cleanup_pop_exec() \
+	pthread_cleanup_pop(1)
+
+/* size of a cache line, which the top and bottom of a deque never share */
+#define TP_CACHE_LINE 64
+
+/* tasks a deque has room for at first, which is a power of 2 */
+#define TP_INITIAL_TASKS 256
+
+/* tasks a worker takes from an injection queue at once */
+#define TP_BATCH 8
+
+struct tp_task {
+	void (*func_)(void *);
+	void *arg_;
+};
+
+/*
+ * A circular array of a deque. An outgrown array is kept until the deque
+ * is destroyed, since a thief may still be reading it.
+ */
+struct tp_array {
+	int64_t mask_;
+	struct tp_array *retired_;
+	_Atomic(struct tp_task *) tasks_[];
+};
+
+/*
+ * A Chase-Lev deque, where its owner pushes and pops tasks at the bottom,
+ * and thieves steal them at the top, in C11 atomics as in Le et al.,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (2013).
+ */
+struct tp_deque {
+	_Alignas(TP_CACHE_LINE) atomic_int_least64_t top_;
+	_Alignas(TP_CACHE_LINE) atomic_int_least64_t bottom_;
+	_Atomic(struct tp_array *) array_;
+};
+
+struct tp_worker {
+	struct tp_deque deque_;
+	struct tp *pool_;
+	pthread_t thread_;
+	uint32_t seed_; /* to choose a victim to steal from */
+};
+
+struct tp {
+	int nr_workers_;
+	struct tp_worker *workers_;
+	struct bq *injector_;
+	atomic_long nr_pending_; /* tasks submitted but not finished */
+	atomic_int nr_idle_; /* workers checking for work to park */
+	_Bool stopping_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_work_;
+	pthread_cond_t cond_done_;
+};
+
+/* prototype */
+static _Bool tp_deque_init(struct tp_deque *);
+static void tp_deque_destroy(struct tp_deque *);
+static _Bool tp_deque_push(struct tp_deque *, struct tp_task *);
+static struct tp_task *tp_deque_pop(struct tp_deque *);
+static struct tp_task *tp_deque_steal(struct tp_deque *);
+static _Bool tp_deque_empty(struct tp_deque *);
+static void *tp_run(void *);
+static void tp_stop(struct tp *, int);
+static void tp_notify(struct tp *);
+static void tp_done(struct tp *);
+
+/* the worker a calling thread is, if any */
+static __thread struct tp_worker *tp_self_ = NULL;
+
+struct tp *tp_new(int nr_workers, int capacity)
+{
+	if (unlikely(nr_workers <= 0 || capacity <= 0))
+		return NULL;
+
+	struct tp *const pool = malloc(sizeof(struct tp));
+	if (unlikely(!pool))
+		return NULL;
+
+	void *workers = NULL;
+	if (unlikely(posix_memalign(&workers, TP_CACHE_LINE,
+			sizeof(struct tp_worker) * nr_workers) != 0)) {
+		free(pool);
+		return NULL;
+	}
+	pool->workers_ = workers;
+
+	pool->injector_ = bq_new_mpmc(capacity);
+	if (unlikely(!pool->injector_)) {
+		free(workers);
+		free(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < nr_workers; ++i) {
+		struct tp_worker *const worker = &pool->workers_[i];
+		if (unlikely(!tp_deque_init(&worker->deque_))) {
+			while (--i >= 0)
+				tp_deque_destroy(&pool->workers_[i].deque_);
+			bq_destroy(pool->injector_, NULL);
+			free(workers);
+			free(pool);
+			return NULL;
+		}
+		worker->pool_ = pool;
+		worker->seed_ = (uint32_t)i + 1;
+	}
+
+	pool->nr_workers_ = nr_workers;
+	atomic_init(&pool->nr_pending_, 0);
+	atomic_init(&pool->nr_idle_, 0);
+	pool->stopping_ = 0;
+	pthread_mutex_init(&pool->mutex_, NULL);
+	pthread_cond_init(&pool->cond_work_, NULL);
+	pthread_cond_init(&pool->cond_done_, NULL);
+
+	for (int i = 0; i < nr_workers; ++i) {
+		struct tp_worker *const worker = &pool->workers_[i];
+		if (unlikely(pthread_create(&worker->thread_, NULL,
+				tp_run, worker) != 0)) {
+			tp_stop(pool, i);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+int tp_nr_workers(const struct tp *pool)
+{
+	return pool->nr_workers_;
+}
+
+_Bool tp_submit(struct tp *pool, void (*func)(void *), void *arg)
+{
+	if (unlikely(!func))
+		return 0;
+
+	struct tp_task *const task = malloc(sizeof(struct tp_task));
+	if (unlikely(!task))
+		return 0;
+	task->func_ = func;
+	task->arg_ = arg;
+
+	atomic_fetch_add_explicit(&pool->nr_pending_, 1, memory_order_relaxed);
+
+	struct tp_worker *const self = tp_self_;
+	const _Bool ret = (self && self->pool_ == pool) ?
+		tp_deque_push(&self->deque_, task) :
+		bq_put(pool->injector_, task);
+	if (unlikely(!ret)) {
+		free(task);
+		tp_done(pool);
+		return 0;
+	}
+
+	tp_notify(pool);
+	return 1;
+}
+
+void tp_wait(struct tp *pool)
+{
+	pthread_cleanup_push_mutex_unlock(&pool->mutex_);
+	pthread_mutex_lock(&pool->mutex_);
+
+	while (atomic_load(&pool->nr_pending_) > 0)
+		pthread_cond_wait(&pool->cond_done_, &pool->mutex_);
+
+	pthread_cleanup_pop_exec(); /* pthread_mutex_unlock */
+}
+
+void tp_destroy(struct tp *pool)
+{
+	tp_wait(pool);
+	tp_stop(pool, pool->nr_workers_);
+}
+
+/*
+ * Stop and join "nr_started" workers, and free a pool.
+ */
+static void tp_stop(struct tp *pool, int nr_started)
+{
+	pthread_mutex_lock(&pool->mutex_);
+	pool->stopping_ = 1;
+	pthread_cond_broadcast(&pool->cond_work_);
+	pthread_mutex_unlock(&pool->mutex_);
+
+	for (int i = 0; i < nr_started; ++i)
+		pthread_join(pool->workers_[i].thread_, NULL);
+
+	for (int i = 0; i < pool->nr_workers_; ++i)
+		tp_deque_destroy(&pool->workers_[i].deque_);
+	bq_destroy(pool->injector_, NULL);
+
+	pthread_mutex_destroy(&pool->mutex_);
+	pthread_cond_destroy(&pool->cond_work_);
+	pthread_cond_destroy(&pool->cond_done_);
+	free(pool->workers_);
+	free(pool);
+}
+
+static void tp_done(struct tp *pool)
+{
+	if (atomic_fetch_sub_explicit(&pool->nr_pending_, 1,
+			memory_order_acq_rel) != 1)
+		return;
+
+	pthread_mutex_lock(&pool->mutex_);
+	pthread_cond_broadcast(&pool->cond_done_);
+	pthread_mutex_unlock(&pool->mutex_);
+}
+
+/*
+ * Wake an idle worker, if any, after making a task visible. Either the
+ * worker sees the task when it checks for work, or this sees the worker.
+ */
+static void tp_notify(struct tp *pool)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (likely(atomic_load_explicit(&pool->nr_idle_,
+			memory_order_relaxed) == 0))
+		return;
+
+	pthread_mutex_lock(&pool->mutex_);
+	pthread_cond_signal(&pool->cond_work_);
+	pthread_mutex_unlock(&pool->mutex_);
+}
+
+static _Bool tp_has_work(struct tp *pool)
+{
+	if (bq_size(pool->injector_) > 0)
+		return 1;
+	for (int i = 0; i < pool->nr_workers_; ++i) {
+		if (!tp_deque_empty(&pool->workers_[i].deque_))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Park a worker until a task may be there.
+ *
+ * @return 0 if a pool is stopping; 1 otherwise.
+ */
+static _Bool tp_park(struct tp *pool)
+{
+	pthread_mutex_lock(&pool->mutex_);
+	atomic_fetch_add(&pool->nr_idle_, 1);
+	atomic_thread_fence(memory_order_seq_cst); /* pairs with tp_notify() */
+
+	const _Bool stopping = pool->stopping_;
+	if (!stopping && !tp_has_work(pool))
+		pthread_cond_wait(&pool->cond_work_, &pool->mutex_);
+
+	atomic_fetch_sub(&pool->nr_idle_, 1);
+	pthread_mutex_unlock(&pool->mutex_);
+	return !stopping;
+}
+
+/*
+ * Take a batch of tasks from an injection queue, and push all but the
+ * first one to the deque of a worker for others to steal.
+ */
+static struct tp_task *tp_take_injected(struct tp_worker *self)
+{
+	struct tp *const pool = self->pool_;
+	struct tp_task *tasks[TP_BATCH];
+	const int n = bq_poll_many(pool->injector_, (void **)tasks, TP_BATCH);
+	if (n <= 0)
+		return NULL;
+
+	for (int i = n - 1; i > 0; --i) {
+		if (unlikely(!tp_deque_push(&self->deque_, tasks[i]))) {
+			tasks[i]->func_(tasks[i]->arg_);
+			free(tasks[i]);
+			tp_done(pool);
+		}
+	}
+	if (n > 1)
+		tp_notify(pool);
+	return tasks[0];
+}
+
+/*
+ * Steal a task from the other workers, starting at a random one.
+ */
+static struct tp_task *tp_steal(struct tp_worker *self)
+{
+	struct tp *const pool = self->pool_;
+	const int nr_workers = pool->nr_workers_;
+
+	/* xorshift32 */
+	uint32_t x = self->seed_;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	self->seed_ = x;
+
+	const int start = (int)(x % (uint32_t)nr_workers);
+	for (int i = 0; i < nr_workers; ++i) {
+		struct tp_worker *const victim =
+			&pool->workers_[(start + i) % nr_workers];
+		if (victim == self)
+			continue;
+		struct tp_task *const task = tp_deque_steal(&victim->deque_);
+		if (task)
+			return task;
+	}
+	return NULL;
+}
+
+static void *tp_run(void *arg)
+{
+	struct tp_worker *const self = arg;
+	struct tp *const pool = self->pool_;
+	tp_self_ = self;
+
+	do {
+		struct tp_task *task = NULL;
+		while ((task = tp_deque_pop(&self->deque_)) ||
+				(task = tp_take_injected(self)) ||
+				(task = tp_steal(self))) {
+			task->func_(task->arg_);
+			free(task);
+			tp_done(pool);
+		}
+	} while (tp_park(pool));
+
+	return NULL;
+}
+
+static struct tp_array *tp_array_new(int64_t nr_tasks)
+{
+	struct tp_array *const array = malloc(sizeof(struct tp_array) +
+		sizeof(struct tp_task *) * nr_tasks);
+	if (unlikely(!array))
+		return NULL;
+
+	array->mask_ = nr_tasks - 1;
+	array->retired_ = NULL;
+	return array;
+}
+
+static _Bool tp_deque_init(struct tp_deque *deque)
+{
+	struct tp_array *const array = tp_array_new(TP_INITIAL_TASKS);
+	if (unlikely(!array))
+		return 0;
+
+	atomic_init(&deque->top_, 0);
+	atomic_init(&deque->bottom_, 0);
+	atomic_init(&deque->array_, array);
+	return 1;
+}
+
+static void tp_deque_destroy(struct tp_deque *deque)
+{
+	struct tp_array *array = atomic_load(&deque->array_);
+	while (array) {
+		struct tp_array *const retired = array->retired_;
+		free(array);
+		array = retired;
+	}
+}
+
+static _Bool tp_deque_empty(struct tp_deque *deque)
+{
+	const int64_t t =
+		atomic_load_explicit(&deque->top_, memory_order_relaxed);
+	const int64_t b =
+		atomic_load_explicit(&deque->bottom_, memory_order_relaxed);
+	return (b <= t);
+}
+
+/*
+ * Double the room of a deque, which only its owner does.
+ */
+static struct tp_array *tp_deque_grow(struct tp_deque *deque,
+	struct tp_array *array, int64_t t, int64_t b)
+{
+	struct tp_array *const grown = tp_array_new((array->mask_ + 1) * 2);
+	if (unlikely(!grown))
+		return NULL;
+
+	for (int64_t i = t; i < b; ++i) {
+		struct tp_task *const task = atomic_load_explicit(
+			&array->tasks_[i & array->mask_], memory_order_relaxed);
+		atomic_store_explicit(&grown->tasks_[i & grown->mask_], task,
+			memory_order_relaxed);
+	}
+	grown->retired_ = array;
+	atomic_store_explicit(&deque->array_, grown, memory_order_release);
+	return grown;
+}
+
+static _Bool tp_deque_push(struct tp_deque *deque, struct tp_task *task)
+{
+	const int64_t b =
+		atomic_load_explicit(&deque->bottom_, memory_order_relaxed);
+	const int64_t t =
+		atomic_load_explicit(&deque->top_, memory_order_acquire);
+	struct tp_array *array =
+		atomic_load_explicit(&deque->array_, memory_order_relaxed);
+
+	if (unlikely(b - t > array->mask_)) {
+		array = tp_deque_grow(deque, array, t, b);
+		if (unlikely(!array))
+			return 0;
+	}
+
+	atomic_store_explicit(&array->tasks_[b & array->mask_], task,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom_, b + 1, memory_order_relaxed);
+	return 1;
+}
+
+static struct tp_task *tp_deque_pop(struct tp_deque *deque)
+{
+	const int64_t b =
+		atomic_load_explicit(&deque->bottom_, memory_order_relaxed) - 1;
+	struct tp_array *const array =
+		atomic_load_explicit(&deque->array_, memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom_, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&deque->top_, memory_order_relaxed);
+
+	if (t > b) {
+		/* empty */
+		atomic_store_explicit(&deque->bottom_, b + 1,
+			memory_order_relaxed);
+		return NULL;
+	}
+
+	struct tp_task *task = atomic_load_explicit(
+		&array->tasks_[b & array->mask_], memory_order_relaxed);
+	if (t == b) {
+		/* the last one, which a thief may be stealing */
+		if (!atomic_compare_exchange_strong_explicit(&deque->top_,
+				&t, t + 1, memory_order_seq_cst,
+				memory_order_relaxed))
+			task = NULL;
+		atomic_store_explicit(&deque->bottom_, b + 1,
+			memory_order_relaxed);
+	}
+	return task;
+}
+
+static struct tp_task *tp_deque_steal(struct tp_deque *deque)
+{
+	int64_t t = atomic_load_explicit(&deque->top_, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	const int64_t b =
+		atomic_load_explicit(&deque->bottom_, memory_order_acquire);
+	if (t >= b)
+		return NULL;
+
+	struct tp_array *const array =
+		atomic_load_explicit(&deque->array_, memory_order_acquire);
+	struct tp_task *const task = atomic_load_explicit(
+		&array->tasks_[t & array->mask_], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top_, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return NULL; /* lost a race with the owner or another thief */
+	return task;
+}
@@ -0,0 +1,56 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Each worker has a deque of its own, to which tasks submitted by tasks
+ * it runs are pushed, and from which it pops the newest one first. Tasks
+ * submitted by other threads go through an injection queue shared by all
+ * workers. A worker with nothing to do steals the oldest task of another
+ * worker, so that workers rarely touch what others touch.
+ */
+struct tp;
+
+/**
+ * Create a new thread pool and start its workers.
+ *
+ * @param nr_workers should be greater than 0.
+ * @param capacity of the injection queue should be greater than 0.
+ * @return a pointer to a new thread pool if success; NULL otherwise.
+ */
+struct tp *tp_new(int nr_workers, int capacity);
+
+/**
+ * @return the number of workers of a thread pool.
+ */
+int tp_nr_workers(const struct tp *pool);
+
+/**
+ * Submit a task which calls "func" with "arg" in a worker.
+ *
+ * A task submitted by a task goes to the deque of the worker running it.
+ * Otherwise, if the injection queue is full, tp_submit() blocks a calling
+ * thread until a worker takes a task from it.
+ *
+ * @return 1 if "func" is not NULL and success; 0 otherwise.
+ */
+_Bool tp_submit(struct tp *pool, void (*func)(void *), void *arg);
+
+/**
+ * Wait for all the submitted tasks, including those they submit, to finish.
+ *
+ * A task should not call tp_wait(), which would wait for the task itself
+ * and never return.
+ */
+void tp_wait(struct tp *pool);
+
+/**
+ * Wait for all the submitted tasks, and destroy a thread pool.
+ *
+ * No task should be submitted once tp_destroy() is called, and a task
+ * should not call tp_destroy(), which would never return as tp_wait().
+ */
+void tp_destroy(struct tp *pool);
+
+#endif /* THREAD_POOL_H */